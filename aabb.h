@@ -12,6 +12,11 @@ class aabb {
         point3 min() const {return minimum;}
         point3 max() const {return maximum;}
 
+        double surface_area() const {
+            vec3 d = maximum - minimum;
+            return 2.0 * (d.x() * d.y() + d.y() * d.z() + d.z() * d.x());
+        }
+
 
         bool hit(const ray& r, double t_min, double t_max ) const{ // very nice implementation
             for(int a = 0; a < 3; a++){
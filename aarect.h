@@ -3,6 +3,7 @@
 
 #include "rtweekend.h"
 #include "hittable.h"
+#include "material.h"
 
 
 class xy_rect : public hittable {
@@ -13,7 +14,12 @@ class xy_rect : public hittable {
         xy_rect( double _x0, double _x1, double _y0, double _y1, double _k, shared_ptr<material> mat)
         : x0(_x0), x1(_x1), y0(_y0), y1(_y1), k{_k}, mp(mat), area((x1 - x0) * (y1 - y0)) {};
 
-        virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const override;
+        virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const override {
+            return deferred_hit(r, t_min, t_max, rec);
+        }
+
+        virtual bool intersect(const ray& r, double t_min, double t_max, hit_query& query, hit_record& rec) const override;
+        virtual void evaluate_surface(const ray& r, const hit_query& query, hit_record& rec) const override;
 
         virtual bool bounding_box(double time0, double time1, aabb& output_box) const override {
             // The bounding box must have non-zero width in each dimension, so pad the Z dimension
@@ -29,20 +35,26 @@ class xy_rect : public hittable {
         }
 
         virtual double pdf_value(const point3& origin, const vec3& v) const override {
+            // only the distance is needed, the normal is the z axis
+            hit_query query;
             hit_record rec;
-            if(!this->hit(ray(origin, v), 0.001, infinity, rec)){
+            if(!this->intersect(ray(origin, v), 0.001, infinity, query, rec)){
                 return 0;
             }
 
             
-            double dist_squared =  rec.t * rec.t * v.length_squared();             
-            double cosine = fabs(dot(v, rec.normal)) / v.length();
+            double dist_squared =  query.t * query.t * v.length_squared();             
+            double cosine = fabs(v.z()) / v.length();
 
             return dist_squared / (cosine * area);
 
             
         }        
 
+        virtual void collect_emitters(const shared_ptr<hittable>& self, std::vector<emitter>& out) const override {
+            collect_if_emitting(self, *mp, area, out);
+        }
+
     public:
         shared_ptr<material> mp;
         double x0, x1, y0, y1, k;
@@ -57,7 +69,12 @@ class xz_rect : public hittable {
         xz_rect( double _x0, double _x1, double _z0, double _z1, double _k, shared_ptr<material> mat)
         : x0(_x0), x1(_x1), z0(_z0), z1(_z1), k{_k}, mp(mat), area((x1 - x0) * (z1 - z0)) {};
 
-        virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const override;
+        virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const override {
+            return deferred_hit(r, t_min, t_max, rec);
+        }
+
+        virtual bool intersect(const ray& r, double t_min, double t_max, hit_query& query, hit_record& rec) const override;
+        virtual void evaluate_surface(const ray& r, const hit_query& query, hit_record& rec) const override;
 
         virtual bool bounding_box(double time0, double time1, aabb& output_box) const override {
             // The bounding box must have non-zero width in each dimension, so pad the normal direction
@@ -68,16 +85,22 @@ class xz_rect : public hittable {
         }
 
          virtual double pdf_value(const point3& origin, const vec3& v) const override {
+            // only the distance is needed, the normal is the y axis
+            hit_query query;
             hit_record rec;
-            if (!this->hit(ray(origin, v), 0.001, infinity, rec))
+            if (!this->intersect(ray(origin, v), 0.001, infinity, query, rec))
                 return 0;
 
-            auto distance_squared = rec.t * rec.t * v.length_squared();
-            auto cosine = fabs(dot(v, rec.normal) / v.length());
+            auto distance_squared = query.t * query.t * v.length_squared();
+            auto cosine = fabs(v.y() / v.length());
 
             return distance_squared / (cosine * area);
         }
 
+        virtual void collect_emitters(const shared_ptr<hittable>& self, std::vector<emitter>& out) const override {
+            collect_if_emitting(self, *mp, area, out);
+        }
+
         virtual vec3 random(const point3& origin) const override {
             auto random_point = point3(random_double(x0,x1), k, random_double(z0,z1));
             return random_point - origin;
@@ -102,7 +125,12 @@ class yz_rect : public hittable {
         yz_rect( double _y0, double _y1, double _z0, double _z1, double _k, shared_ptr<material> mat)
         : y0(_y0), y1(_y1), z0(_z0), z1(_z1), k{_k}, mp(mat), area((y1 - y0) * (z1 - z0)) {};
 
-        virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const override;
+        virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const override {
+            return deferred_hit(r, t_min, t_max, rec);
+        }
+
+        virtual bool intersect(const ray& r, double t_min, double t_max, hit_query& query, hit_record& rec) const override;
+        virtual void evaluate_surface(const ray& r, const hit_query& query, hit_record& rec) const override;
 
         virtual bool bounding_box(double time0, double time1, aabb& output_box) const override {
             // The bounding box must have non-zero width in each dimension, so pad the Z dimension
@@ -117,19 +145,25 @@ class yz_rect : public hittable {
             return o_prime - o;
         }
 
-        virtual double value(const point3& origin, const vec3& v){
+        virtual double pdf_value(const point3& origin, const vec3& v) const override {
+            // only the distance is needed, the normal is the x axis
+            hit_query query;
             hit_record rec;
-            if(!this->hit(ray(origin, v), 0.001, infinity, rec)){
+            if(!this->intersect(ray(origin, v), 0.001, infinity, query, rec)){
                 return 0;
             }
 
 
-            double dist_squared =  rec.t * rec.t * v.length_squared();             
-            double cosine = fabs(dot(v, rec.normal)) / v.length();
+            double dist_squared =  query.t * query.t * v.length_squared();             
+            double cosine = fabs(v.x()) / v.length();
             return dist_squared / (cosine * area);
             
         }
 
+        virtual void collect_emitters(const shared_ptr<hittable>& self, std::vector<emitter>& out) const override {
+            collect_if_emitting(self, *mp, area, out);
+        }
+
 
     
 
@@ -141,7 +175,8 @@ class yz_rect : public hittable {
 };
 
 
-bool xy_rect::hit(const ray& r, double t_min, double t_max, hit_record& rec) const {
+// the plane coordinates already give the uvs, so the query carries them
+bool xy_rect::intersect(const ray& r, double t_min, double t_max, hit_query& query, hit_record&) const {
     auto t = (k - r.origin().z()) / r.direction().z();
     if(t < t_min || t > t_max){
         return false;
@@ -152,18 +187,24 @@ bool xy_rect::hit(const ray& r, double t_min, double t_max, hit_record& rec) con
     if(x < x0 || x > x1 || y < y0 || y > y1)
         return false;
 
-    rec.u = (x - x0) / (x1 - x0);
-    rec.v = (y - y0) / (y1 - y0);
-    rec.t = t;
-    auto outward_normal = vec3(0,0,1);
-    rec.set_face_normal(r, outward_normal);
-    rec.mat_ptr = mp;
-    rec.p = r.at(t);
+    query.u = (x - x0) / (x1 - x0);
+    query.v = (y - y0) / (y1 - y0);
+    query.t = t;
     return true;
 
 }
 
-bool xz_rect::hit(const ray& r, double t_min, double t_max, hit_record& rec) const {
+void xy_rect::evaluate_surface(const ray& r, const hit_query& query, hit_record& rec) const {
+    rec.u = query.u;
+    rec.v = query.v;
+    rec.t = query.t;
+    auto outward_normal = vec3(0,0,1);
+    rec.set_face_normal(r, outward_normal);
+    rec.mat_ptr = mp.get();
+    rec.p = r.at(rec.t);
+}
+
+bool xz_rect::intersect(const ray& r, double t_min, double t_max, hit_query& query, hit_record&) const {
     auto t = (k-r.origin().y()) / r.direction().y();
     if (t < t_min || t > t_max)
         return false;
@@ -171,17 +212,23 @@ bool xz_rect::hit(const ray& r, double t_min, double t_max, hit_record& rec) con
     auto z = r.origin().z() + t*r.direction().z();
     if (x < x0 || x > x1 || z < z0 || z > z1)
         return false;
-    rec.u = (x-x0)/(x1-x0);
-    rec.v = (z-z0)/(z1-z0);
-    rec.t = t;
+    query.u = (x-x0)/(x1-x0);
+    query.v = (z-z0)/(z1-z0);
+    query.t = t;
+    return true;
+}
+
+void xz_rect::evaluate_surface(const ray& r, const hit_query& query, hit_record& rec) const {
+    rec.u = query.u;
+    rec.v = query.v;
+    rec.t = query.t;
     auto outward_normal = vec3(0, 1, 0);
     rec.set_face_normal(r, outward_normal);
-    rec.mat_ptr = mp;
-    rec.p = r.at(t);
-    return true;
+    rec.mat_ptr = mp.get();
+    rec.p = r.at(rec.t);
 }
 
-bool yz_rect::hit(const ray& r, double t_min, double t_max, hit_record& rec) const {
+bool yz_rect::intersect(const ray& r, double t_min, double t_max, hit_query& query, hit_record&) const {
     auto t = (k-r.origin().x()) / r.direction().x();
     if (t < t_min || t > t_max)
         return false;
@@ -189,14 +236,20 @@ bool yz_rect::hit(const ray& r, double t_min, double t_max, hit_record& rec) con
     auto z = r.origin().z() + t*r.direction().z();
     if (y < y0 || y > y1 || z < z0 || z > z1)
         return false;
-    rec.u = (y-y0)/(y1-y0);
-    rec.v = (z-z0)/(z1-z0);
-    rec.t = t;
+    query.u = (y-y0)/(y1-y0);
+    query.v = (z-z0)/(z1-z0);
+    query.t = t;
+    return true;
+}
+
+void yz_rect::evaluate_surface(const ray& r, const hit_query& query, hit_record& rec) const {
+    rec.u = query.u;
+    rec.v = query.v;
+    rec.t = query.t;
     auto outward_normal = vec3(1, 0, 0);
     rec.set_face_normal(r, outward_normal);
-    rec.mat_ptr = mp;
-    rec.p = r.at(t);
-    return true;
+    rec.mat_ptr = mp.get();
+    rec.p = r.at(rec.t);
 }
 
 #endif
@@ -10,6 +10,14 @@ class box : public hittable{
         box() {}
         box(const point3& p0, const point3& p1, shared_ptr<material> ptr);
         virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const override;
+        virtual bool intersect(const ray& r, double t_min, double t_max, hit_query& query, hit_record& rec) const override;
+        virtual void evaluate_surface(const ray& r, const hit_query& query, hit_record& rec) const override;
+        virtual bool occluded(const ray& r, double t_min, double t_max) const override {
+            return sides.occluded(r, t_min, t_max);
+        }
+        virtual void collect_emitters(const shared_ptr<hittable>& self, std::vector<emitter>& out) const override {
+            sides.collect_emitters(self, out);
+        }
         virtual bool bounding_box(double time0, double time1, aabb& output_box) const override {
             output_box = aabb(box_min, box_max);
             return true;
@@ -39,7 +47,24 @@ box::box(const point3& p0, const point3& p1, shared_ptr<material> ptr){
 }
 
 bool box::hit(const ray& r, double t_min, double t_max, hit_record& rec) const{
-    return sides.hit(r, t_min, t_max, rec);
+    return deferred_hit(r, t_min, t_max, rec);
+}
+
+// the sides are rects, which leave id free, so the side that was hit goes there
+bool box::intersect(const ray& r, double t_min, double t_max, hit_query& query, hit_record& rec) const{
+    bool hit_anything = false;
+    for(uint32_t k = 0; k < sides.objects.size(); k++){
+        if(sides.objects[k]->intersect(r, t_min, t_max, query, rec)){
+            t_max = query.t;
+            query.id = k;
+            hit_anything = true;
+        }
+    }
+    return hit_anything;
+}
+
+void box::evaluate_surface(const ray& r, const hit_query& query, hit_record& rec) const{
+    sides.objects[query.id]->evaluate_surface(r, query, rec);
 }
 
 
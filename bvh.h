@@ -3,6 +3,13 @@
 
 
 #include <algorithm>
+#include <vector>
+#include <cstdint>
+#include <cmath>
+#include <limits>
+#if defined(__SSE__) || defined(_M_X64)
+#include <xmmintrin.h>
+#endif
 
 #include "rtweekend.h"
 #include "hittable.h"
@@ -11,31 +18,100 @@
 
 
 
-inline bool box_compare(const shared_ptr<hittable> a, const shared_ptr<hittable> b, int axis){
-    aabb box_a, box_b;
-    
-    if(!a -> bounding_box(0,0, box_a) || !b -> bounding_box(0,0,box_b)){
-        std::cerr << "No bounding box in bvh_node constructor.\n";
+/*
+Binned surface area heuristic, shared by both bvh builders. Every primitive is dropped into one of
+sah_bin_count bins by its centroid along an axis, and each bin boundary on each of the three axes is
+scored by the expected cost of a ray that reaches the node,
+    traversal + (area_left * count_left + area_right * count_right) / area_node
+The primitives are then partitioned around the cheapest boundary. Only precomputed boxes and centroids
+are touched, and ties go to the lowest axis and bin, so a given scene always builds the same tree.
+When leaves are intersected leaf_width primitives at a time (simd leaf kernels), a count stands for
+the number of such batches, rounded up, instead of the number of primitives.
+*/
+const int sah_bin_count = 16;
+const double sah_traversal_cost = 0.5;
+
+// partitions prims[0, count) and returns the size of the left half, or 0 when the primitives should
+// stay together as a leaf (never chosen for more than max_leaf_size of them)
+inline uint32_t sah_partition(const std::vector<aabb>& boxes, const std::vector<point3>& centroids,
+                              uint32_t* prims, uint32_t count, int max_leaf_size, int& axis, int leaf_width = 1){
+    axis = 0;
+    auto batches = [&](uint32_t n){ return (double)((n + leaf_width - 1) / leaf_width); };
+    if(count <= 1) return 0;
+    // what fits in one batch is tested as a unit anyway, splitting it would only add nodes
+    if(leaf_width > 1 && (int)count <= std::min(leaf_width, max_leaf_size)) return 0;
+
+    aabb node_box = boxes[prims[0]];
+    point3 cmin = centroids[prims[0]], cmax = cmin;
+    for(uint32_t k = 1; k < count; k++){
+        node_box = surrounding_box(node_box, boxes[prims[k]]);
+        for(int a = 0; a < 3; a++){
+            cmin[a] = fmin(cmin[a], centroids[prims[k]][a]);
+            cmax[a] = fmax(cmax[a], centroids[prims[k]][a]);
+        }
     }
 
-    return box_a.min().e[axis] < box_b.min().e[axis];
+    double node_area = node_box.surface_area();
+    double best_cost = infinity;
+    int best_axis = -1, best_bin = 0;
 
+    for(int a = 0; a < 3; a++){
+        double extent = cmax[a] - cmin[a];
+        if(extent <= 0) continue;
 
-}
+        uint32_t bin_count[sah_bin_count] = {};
+        aabb bin_box[sah_bin_count];
+        double scale = sah_bin_count / extent;
 
+        for(uint32_t k = 0; k < count; k++){
+            int b = std::min(sah_bin_count - 1, (int)((centroids[prims[k]][a] - cmin[a]) * scale));
+            bin_box[b] = bin_count[b] ? surrounding_box(bin_box[b], boxes[prims[k]]) : boxes[prims[k]];
+            bin_count[b]++;
+        }
 
-bool box_x_compare(const shared_ptr<hittable> a, const shared_ptr<hittable> b){
-    return box_compare(a,b,0);
-}
+        // sweep from the right to get the cost of everything above each boundary
+        double right_area[sah_bin_count];
+        uint32_t right_count[sah_bin_count];
+        aabb acc;
+        uint32_t n = 0;
+        for(int b = sah_bin_count - 1; b > 0; b--){
+            if(bin_count[b]) acc = n ? surrounding_box(acc, bin_box[b]) : bin_box[b];
+            n += bin_count[b];
+            right_area[b] = n ? acc.surface_area() : 0;
+            right_count[b] = n;
+        }
 
-bool box_y_compare(const shared_ptr<hittable> a, const shared_ptr<hittable> b){
-    return box_compare(a,b,1);
-}
+        n = 0;
+        for(int b = 0; b < sah_bin_count - 1; b++){
+            if(bin_count[b]) acc = n ? surrounding_box(acc, bin_box[b]) : bin_box[b];
+            n += bin_count[b];
+            if(n == 0 || right_count[b + 1] == 0) continue;
+
+            double cost = sah_traversal_cost
+                + (acc.surface_area() * batches(n) + right_area[b + 1] * batches(right_count[b + 1])) / node_area;
+            if(cost < best_cost){
+                best_cost = cost;
+                best_axis = a;
+                best_bin = b;
+            }
+        }
+    }
 
-bool box_z_compare(const shared_ptr<hittable> a, const shared_ptr<hittable> b){
-    return box_compare(a,b,2);
-}
+    // every centroid in the same spot, no boundary separates anything
+    if(best_axis < 0){
+        if((int)count <= max_leaf_size) return 0;
+        return count / 2;
+    }
 
+    if((int)count <= max_leaf_size && batches(count) <= best_cost) return 0;
+
+    axis = best_axis;
+    double scale = sah_bin_count / (cmax[axis] - cmin[axis]);
+    uint32_t* mid = std::partition(prims, prims + count, [&](uint32_t prim){
+        return std::min(sah_bin_count - 1, (int)((centroids[prim][axis] - cmin[axis]) * scale)) <= best_bin;
+    });
+    return (uint32_t)(mid - prims);
+}
 
 
 class bvh_node : public hittable {
@@ -49,6 +125,12 @@ class bvh_node : public hittable {
            size_t start, size_t end, double time0, double time1);
 
         virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const override;
+        virtual bool occluded(const ray& r, double t_min, double t_max) const override;
+
+        virtual void collect_emitters(const shared_ptr<hittable>&, std::vector<emitter>& out) const override {
+            left->collect_emitters(left, out);
+            if(right != left) right->collect_emitters(right, out);
+        }
 
         virtual bool bounding_box(double time0, double time1, aabb& output_box) const override;
 
@@ -58,6 +140,10 @@ class bvh_node : public hittable {
         shared_ptr<hittable> right;
         aabb box;
 
+    private:
+        bvh_node(const std::vector<shared_ptr<hittable>>& objects, const std::vector<aabb>& boxes,
+           const std::vector<point3>& centroids, uint32_t* prims, uint32_t count);
+
 
 };
  bool bvh_node::bounding_box(double time0, double time1, aabb& output_box) const {
@@ -76,45 +162,774 @@ class bvh_node : public hittable {
     
     }
 
+    bool bvh_node::occluded(const ray& r, double t_min, double t_max) const{
+        if(!box.hit(r, t_min, t_max))
+            return false;
+
+        return left->occluded(r, t_min, t_max) || right->occluded(r, t_min, t_max);
+    }
+
 
 bvh_node::bvh_node(std::vector<shared_ptr<hittable>>& src_objects,
     size_t start, size_t end, double time0, double time1){
 
-        int axis = random_int(0,2);
-        auto comparator = (axis == 0) ? box_x_compare
-                        : (axis == 1) ? box_y_compare
-                        : box_z_compare;
+        // boxes and centroids are computed once up front rather than on every comparison
+        std::vector<shared_ptr<hittable>> objects(src_objects.begin() + start, src_objects.begin() + end);
+        std::vector<aabb> boxes(objects.size());
+        std::vector<point3> centroids(objects.size());
+        std::vector<uint32_t> prims(objects.size());
+
+        for(size_t k = 0; k < objects.size(); k++){
+            if(!objects[k]->bounding_box(time0, time1, boxes[k]))
+                std::cerr << "No bounding box in bvh_node constructor.\n";
+            centroids[k] = 0.5 * (boxes[k].min() + boxes[k].max());
+            prims[k] = (uint32_t)k;
+        }
+
+        *this = bvh_node(objects, boxes, centroids, prims.data(), (uint32_t)prims.size());
+     }
+
+
+bvh_node::bvh_node(const std::vector<shared_ptr<hittable>>& objects, const std::vector<aabb>& boxes,
+    const std::vector<point3>& centroids, uint32_t* prims, uint32_t count){
+
+        if(count == 1){
+            left = right = objects[prims[0]];
+            box = boxes[prims[0]];
+            return;
+        }
+
+        int axis;
+        uint32_t mid = sah_partition(boxes, centroids, prims, count, 1, axis);
+
+        auto child = [&](uint32_t* first, uint32_t n) -> shared_ptr<hittable> {
+            if(n == 1) return objects[first[0]];
+            return shared_ptr<bvh_node>(new bvh_node(objects, boxes, centroids, first, n));
+        };
+
+        left = child(prims, mid);
+        right = child(prims + mid, count - mid);
+
+        box = boxes[prims[0]];
+        for(uint32_t k = 1; k < count; k++){
+            box = surrounding_box(box, boxes[prims[k]]);
+        }
+     }
+
+
+/*
+Flattened bvh. Nodes are 32 bytes and stored depth first in one array: an interior node's first
+child sits right after it and 'offset' holds the index of its second child, while a leaf (count > 0)
+covers prim_indices[offset, offset + count). Bounds are stored as floats rounded outward so a node
+box never shrinks below the doubles it was built from.
+Traversal walks the array with an explicit stack and descends into the child on the near side of
+the split first (picked from the sign of the ray direction on the split axis), so closer hits are
+found early and shrink t_max for the rest of the walk.
+*/
+struct linear_bvh_node {
+    float bounds_min[3];
+    float bounds_max[3];
+    uint32_t offset;
+    uint16_t count;
+    uint8_t axis;
+    uint8_t pad;
+};
+
+static_assert(sizeof(linear_bvh_node) == 32, "linear_bvh_node should stay 32 bytes");
+
+
+class flat_bvh {
+    public:
+        flat_bvh() {}
+
+        // builds the tree over one box per primitive. leaf_width as in sah_partition
+        void build(const std::vector<aabb>& prim_boxes, int max_leaf_size = 4, int leaf_width = 1){
+            nodes.clear();
+            prim_indices.resize(prim_boxes.size());
+            for(size_t k = 0; k < prim_boxes.size(); k++) prim_indices[k] = (uint32_t)k;
+            if(prim_boxes.empty()) return;
+
+            centroids.resize(prim_boxes.size());
+            for(size_t k = 0; k < prim_boxes.size(); k++){
+                centroids[k] = 0.5 * (prim_boxes[k].min() + prim_boxes[k].max());
+            }
+
+            nodes.reserve(2 * prim_boxes.size());
+            build_recursive(prim_boxes, 0, (uint32_t)prim_boxes.size(), max_leaf_size, leaf_width, 0);
+
+            centroids.clear();
+            centroids.shrink_to_fit();
+        }
 
+        bool empty() const { return nodes.empty(); }
 
-        size_t object_span = end - start;
-        if(object_span == 1){
-            left = right = src_objects[start];
-        }else if(object_span == 2){
-            if(comparator(src_objects[start], src_objects[start + 1])){
-                left = src_objects[start];  
-                right = src_objects[start + 1];
+        aabb bounds() const {
+            if(nodes.empty()) return aabb();
+            const linear_bvh_node& root = nodes[0];
+            return aabb(point3(root.bounds_min[0], root.bounds_min[1], root.bounds_min[2]),
+                        point3(root.bounds_max[0], root.bounds_max[1], root.bounds_max[2]));
+        }
+
+        // calls leaf_hit(prim, t_max) for every primitive in a leaf the ray reaches. leaf_hit returns
+        // true when it found a hit closer than t_max, and lowers t_max to it
+        template<class leaf_function>
+        bool traverse(const ray& r, double t_min, double& t_max, leaf_function&& leaf_hit) const {
+            return traverse_leaves(r, t_min, t_max, [&](uint32_t first, uint32_t count, double& closest){
+                bool hit_anything = false;
+                for(uint32_t k = 0; k < count; k++){
+                    if(leaf_hit(prim_indices[first + k], closest)) hit_anything = true;
+                }
+                return hit_anything;
+            });
+        }
+
+        // same walk, but hands each leaf over as its range [first, first + count) of prim_indices. for
+        // primitives stored in tree order (see reorder) that is directly a range of primitives
+        template<class leaf_function>
+        bool traverse_leaves(const ray& r, double t_min, double& t_max, leaf_function&& leaf_hit) const {
+            if(nodes.empty()) return false;
+
+            const vec3 dir = r.direction();
+            const point3 orig = r.origin();
+            const vec3 inv_dir(1.0 / dir.x(), 1.0 / dir.y(), 1.0 / dir.z());
+            const bool dir_neg[3] = {inv_dir.x() < 0, inv_dir.y() < 0, inv_dir.z() < 0};
+
+            uint32_t stack[64];
+            int stack_size = 0;
+            uint32_t current = 0;
+            bool hit_anything = false;
+
+            while(true){
+                const linear_bvh_node& node = nodes[current];
+
+                if(node_hit(node, orig, inv_dir, t_min, t_max)){
+                    if(node.count > 0){
+                        if(leaf_hit(node.offset, (uint32_t)node.count, t_max)) hit_anything = true;
+                        if(stack_size == 0) break;
+                        current = stack[--stack_size];
+                    }else if(dir_neg[node.axis]){
+                        stack[stack_size++] = current + 1;
+                        current = node.offset;
+                    }else{
+                        stack[stack_size++] = node.offset;
+                        current = current + 1;
+                    }
+                }else{
+                    if(stack_size == 0) break;
+                    current = stack[--stack_size];
+                }
+            }
+
+            return hit_anything;
+        }
+
+        // any hit rather than the closest: prim_occluded(prim) returns true when the primitive blocks the
+        // ray within [t_min, t_max], and the walk ends right there
+        template<class prim_function>
+        bool any_hit(const ray& r, double t_min, double t_max, prim_function&& prim_occluded) const {
+            return any_hit_leaves(r, t_min, t_max, [&](uint32_t first, uint32_t count){
+                for(uint32_t k = 0; k < count; k++){
+                    if(prim_occluded(prim_indices[first + k])) return true;
+                }
+                return false;
+            });
+        }
+
+        // any_hit handing over whole leaves, as traverse_leaves does
+        template<class leaf_function>
+        bool any_hit_leaves(const ray& r, double t_min, double t_max, leaf_function&& leaf_occluded) const {
+            if(nodes.empty()) return false;
+
+            const vec3 dir = r.direction();
+            const point3 orig = r.origin();
+            const vec3 inv_dir(1.0 / dir.x(), 1.0 / dir.y(), 1.0 / dir.z());
+
+            uint32_t stack[64];
+            int stack_size = 0;
+            uint32_t current = 0;
+
+            while(true){
+                const linear_bvh_node& node = nodes[current];
+
+                if(node_hit(node, orig, inv_dir, t_min, t_max)){
+                    if(node.count > 0){
+                        if(leaf_occluded(node.offset, (uint32_t)node.count)) return true;
+                        if(stack_size == 0) break;
+                        current = stack[--stack_size];
+                    }else{
+                        stack[stack_size++] = node.offset;
+                        current = current + 1;
+                    }
+                }else{
+                    if(stack_size == 0) break;
+                    current = stack[--stack_size];
+                }
+            }
+
+            return false;
+        }
+
+        // permutes per primitive data into tree order, after which leaf ranges index it directly and
+        // prim_indices is no longer needed by traverse_leaves
+        template<class T>
+        void reorder(std::vector<T>& data) const {
+            std::vector<T> sorted;
+            sorted.reserve(prim_indices.size());
+            for(uint32_t prim : prim_indices) sorted.push_back(data[prim]);
+            data.swap(sorted);
+        }
+
+    public:
+        std::vector<linear_bvh_node> nodes;
+        std::vector<uint32_t> prim_indices;
+
+    private:
+        std::vector<point3> centroids;
+
+        // slab test against the precomputed inverse direction. the comparisons are written so a NaN
+        // (0 * inf for a ray lying in a slab plane) leaves the interval untouched
+        static bool node_hit(const linear_bvh_node& node, const point3& orig, const vec3& inv_dir, double t_min, double t_max){
+            for(int a = 0; a < 3; a++){
+                double t0 = (node.bounds_min[a] - orig[a]) * inv_dir[a];
+                double t1 = (node.bounds_max[a] - orig[a]) * inv_dir[a];
+                if(inv_dir[a] < 0) std::swap(t0, t1);
+                t_min = t0 > t_min ? t0 : t_min;
+                t_max = t1 < t_max ? t1 : t_max;
+                if(t_max <= t_min) return false;
+            }
+            return true;
+        }
+
+        static float round_down(double x){
+            float f = (float)x;
+            return (double)f > x ? std::nextafter(f, -INFINITY) : f;
+        }
+
+        static float round_up(double x){
+            float f = (float)x;
+            return (double)f < x ? std::nextafter(f, INFINITY) : f;
+        }
+
+        // a balanced split below this depth keeps the whole tree within the 64 entry traversal stack
+        static const int max_sah_depth = 32;
+
+        uint32_t build_recursive(const std::vector<aabb>& prim_boxes, uint32_t begin, uint32_t end, int max_leaf_size,
+                                 int leaf_width, int depth){
+            uint32_t index = (uint32_t)nodes.size();
+            nodes.push_back(linear_bvh_node());
+
+            aabb box = prim_boxes[prim_indices[begin]];
+            for(uint32_t k = begin + 1; k < end; k++){
+                box = surrounding_box(box, prim_boxes[prim_indices[k]]);
+            }
+
+            for(int a = 0; a < 3; a++){
+                nodes[index].bounds_min[a] = round_down(box.min()[a]);
+                nodes[index].bounds_max[a] = round_up(box.max()[a]);
+            }
+
+            uint32_t count = end - begin;
+            int axis = 0;
+            uint32_t split;
+            if(depth >= max_sah_depth){
+                // deep enough that the traversal stack is at risk, finish with balanced splits
+                split = count <= (uint32_t)max_leaf_size ? 0 : count / 2;
             }else{
-                left = src_objects[start + 1];
-                right = src_objects[start];
+                split = sah_partition(prim_boxes, centroids, prim_indices.data() + begin, count, max_leaf_size, axis, leaf_width);
+            }
+
+            if(split == 0){
+                nodes[index].offset = begin;
+                nodes[index].count = (uint16_t)count;
+                nodes[index].axis = 0;
+                return index;
             }
-        
-        }else{
-            std::sort(src_objects.begin() + start, src_objects.begin() + end, comparator);
 
-            auto mid = start + object_span/2;
-            left = make_shared<bvh_node>(src_objects, start, mid, time0, time1);
-            right = make_shared<bvh_node>(src_objects, mid, end, time0, time1);
+            build_recursive(prim_boxes, begin, begin + split, max_leaf_size, leaf_width, depth + 1);
+            uint32_t second = build_recursive(prim_boxes, begin + split, end, max_leaf_size, leaf_width, depth + 1);
 
+            nodes[index].offset = second;
+            nodes[index].count = 0;
+            nodes[index].axis = (uint8_t)axis;
+            return index;
         }
+};
 
-        aabb box_left, box_right;
-        if(!left -> bounding_box(time0,time1,box_left) || !right -> bounding_box(time0,time1,box_right))
-            std::cerr << "No bounding box in bvh_node constructor.\n";
-        
-        box = surrounding_box(box_left, box_right);
 
+/*
+Four wide bvh (qbvh), made by collapsing the binary flat_bvh: each node takes up to four subtrees,
+opening the largest interior one until there are four, so a single node step does the work of about
+two binary levels. The four child boxes are stored structure of arrays, bounds[plane][child] with
+the planes min x, min y, min z, max x, max y, max z, and tested in one go with SSE (a plain loop with
+identical results where SSE is unavailable). Unused slots hold an inverted box that no ray can hit.
+A child with count > 0 is a leaf covering prim_indices[child, child + count), otherwise child is the
+index of another node. Traversal visits the children that were hit nearest first and drops any
+pending entry whose entry distance lies beyond the closest hit found since it was pushed.
+*/
+struct alignas(16) wide_bvh_node {
+    float bounds[6][4];
+    uint32_t child[4];
+    uint16_t count[4];
+    uint32_t pad[2];
+
+    wide_bvh_node() : child{}, count{}, pad{} {
+        for(int i = 0; i < 4; i++){
+            bounds[0][i] = bounds[1][i] = bounds[2][i] = INFINITY;
+            bounds[3][i] = bounds[4][i] = bounds[5][i] = -INFINITY;
+        }
+    }
+};
 
-     }
+static_assert(sizeof(wide_bvh_node) == 128, "wide_bvh_node should stay two cache lines");
+
+
+// a ray prepared for box tests: origin and inverse direction in float, and for each axis which plane
+// of a box the ray enters through, so the slab test needs neither divisions nor swaps.
+// rounding the origin to float moves every slab distance by up to |o - float(o)| * |inv_dir|, which no
+// relative widening covers for boxes close to the origin, so t_slack holds (twice) that shift per axis
+// and each slab interval is widened by it on both ends. axes the ray runs parallel to have no finite
+// distances to shift and get none
+struct bvh_ray {
+    float orig[3];
+    float inv_dir[3];
+    int near_plane[3];
+    int far_plane[3];
+    float t_slack[3];
+
+    explicit bvh_ray(const ray& r){
+        for(int a = 0; a < 3; a++){
+            orig[a] = (float)r.origin()[a];
+            inv_dir[a] = (float)(1.0 / r.direction()[a]);
+            bool negative = std::signbit(inv_dir[a]);
+            near_plane[a] = negative ? a + 3 : a;
+            far_plane[a] = negative ? a : a + 3;
+
+            double shift = fabs(r.origin()[a] - (double)orig[a]) / fabs(r.direction()[a]);
+            t_slack[a] = std::isfinite(shift) ? (float)(2 * shift) : 0.0f;
+        }
+    }
+};
+
+
+class wide_bvh {
+    public:
+        wide_bvh() {}
+
+        // builds the binary tree over one box per primitive and collapses it
+        void build(const std::vector<aabb>& prim_boxes, int max_leaf_size = 4, int leaf_width = 1){
+            flat_bvh binary;
+            binary.build(prim_boxes, max_leaf_size, leaf_width);
+
+            nodes.clear();
+            prim_indices = std::move(binary.prim_indices);
+            if(binary.empty()) return;
+
+            nodes.reserve(binary.nodes.size() / 2 + 1);
+            collapse(binary.nodes, 0);
+        }
+
+        bool empty() const { return nodes.empty(); }
+
+        aabb bounds() const {
+            if(nodes.empty()) return aabb();
+            const wide_bvh_node& root = nodes[0];
+            point3 lo(INFINITY, INFINITY, INFINITY), hi(-INFINITY, -INFINITY, -INFINITY);
+            for(int i = 0; i < 4; i++){
+                for(int a = 0; a < 3; a++){
+                    lo[a] = fmin(lo[a], root.bounds[a][i]);
+                    hi[a] = fmax(hi[a], root.bounds[a + 3][i]);
+                }
+            }
+            return aabb(lo, hi);
+        }
+
+        // same contract as flat_bvh::traverse
+        template<class leaf_function>
+        bool traverse(const ray& r, double t_min, double& t_max, leaf_function&& leaf_hit) const {
+            return traverse_leaves(r, t_min, t_max, [&](uint32_t first, uint32_t count, double& closest){
+                bool hit_anything = false;
+                for(uint32_t k = 0; k < count; k++){
+                    if(leaf_hit(prim_indices[first + k], closest)) hit_anything = true;
+                }
+                return hit_anything;
+            });
+        }
+
+        // same contract as flat_bvh::traverse_leaves
+        template<class leaf_function>
+        bool traverse_leaves(const ray& r, double t_min, double& t_max, leaf_function&& leaf_hit) const {
+            if(nodes.empty()) return false;
+
+            const bvh_ray query(r);
+
+            // every node pushes at most three entries besides the one it continues with, and the tree
+            // is no deeper than the binary one it came from
+            stack_entry stack[3 * 64 + 1];
+            int stack_size = 0;
+            stack[stack_size++] = {0, 0, (float)t_min};
+            bool hit_anything = false;
+
+            while(stack_size > 0){
+                stack_entry entry = stack[--stack_size];
+                if(entry.t_near > t_max) continue;
+
+                if(entry.count > 0){
+                    if(leaf_hit(entry.index, (uint32_t)entry.count, t_max)) hit_anything = true;
+                    continue;
+                }
+
+                const wide_bvh_node& node = nodes[entry.index];
+                float t_near[4];
+                int mask = node_hit(node, query, t_min, t_max, t_near);
+                if(mask == 0) continue;
+
+                // children that were hit, ordered farthest first so the nearest is popped next
+                stack_entry hits[4];
+                int n = 0;
+                for(int i = 0; i < 4; i++){
+                    if(!(mask & (1 << i))) continue;
+                    stack_entry e = {node.child[i], node.count[i], t_near[i]};
+                    int j = n++;
+                    for(; j > 0 && hits[j - 1].t_near < e.t_near; j--) hits[j] = hits[j - 1];
+                    hits[j] = e;
+                }
+                for(int i = 0; i < n; i++) stack[stack_size++] = hits[i];
+            }
+
+            return hit_anything;
+        }
+
+        // same contract as flat_bvh::any_hit
+        template<class prim_function>
+        bool any_hit(const ray& r, double t_min, double t_max, prim_function&& prim_occluded) const {
+            return any_hit_leaves(r, t_min, t_max, [&](uint32_t first, uint32_t count){
+                for(uint32_t k = 0; k < count; k++){
+                    if(prim_occluded(prim_indices[first + k])) return true;
+                }
+                return false;
+            });
+        }
+
+        // same contract as flat_bvh::any_hit_leaves. any hit ends the walk, so children are taken in
+        // slot order without sorting them by distance
+        template<class leaf_function>
+        bool any_hit_leaves(const ray& r, double t_min, double t_max, leaf_function&& leaf_occluded) const {
+            if(nodes.empty()) return false;
+
+            const bvh_ray query(r);
+
+            stack_entry stack[3 * 64 + 1];
+            int stack_size = 0;
+            stack[stack_size++] = {0, 0, (float)t_min};
+
+            while(stack_size > 0){
+                stack_entry entry = stack[--stack_size];
+
+                if(entry.count > 0){
+                    if(leaf_occluded(entry.index, (uint32_t)entry.count)) return true;
+                    continue;
+                }
+
+                const wide_bvh_node& node = nodes[entry.index];
+                float t_near[4];
+                int mask = node_hit(node, query, t_min, t_max, t_near);
+                for(int i = 0; i < 4; i++){
+                    if(mask & (1 << i)) stack[stack_size++] = {node.child[i], node.count[i], t_near[i]};
+                }
+            }
+
+            return false;
+        }
+
+        // same contract as flat_bvh::reorder
+        template<class T>
+        void reorder(std::vector<T>& data) const {
+            std::vector<T> sorted;
+            sorted.reserve(prim_indices.size());
+            for(uint32_t prim : prim_indices) sorted.push_back(data[prim]);
+            data.swap(sorted);
+        }
+
+        // for simd leaf kernels: pack(prims, count) gathers the primitives of one leaf into a packet
+        // and returns its index, and the leaf is rewritten to cover just that packet. prim_indices is
+        // dropped afterwards, as leaf ranges then index packets
+        template<class pack_function>
+        void pack_leaves(pack_function&& pack){
+            for(wide_bvh_node& node : nodes){
+                for(int i = 0; i < 4; i++){
+                    if(node.count[i] == 0) continue;
+                    node.child[i] = pack(&prim_indices[node.child[i]], (uint32_t)node.count[i]);
+                    node.count[i] = 1;
+                }
+            }
+            prim_indices = std::vector<uint32_t>();
+        }
+
+    public:
+        std::vector<wide_bvh_node> nodes;
+        std::vector<uint32_t> prim_indices;
+
+    private:
+        struct stack_entry {
+            uint32_t index;
+            uint16_t count;
+            float t_near;
+        };
+
+        // bit i of the result is set when the ray enters child box i within [t_min, t_max], whose
+        // entry distance goes to t_near[i]. to make up for testing in float every slab is widened by the
+        // origin's t_slack and the final interval by a few ulps at both ends, so rounding never loses a
+        // box, and a NaN (0 * inf for a ray lying in a slab plane) leaves the interval as is
+        static int node_hit(const wide_bvh_node& node, const bvh_ray& query, double t_min, double t_max, float t_near[4]){
+            const float widen = 1.0f + 4.0f * std::numeric_limits<float>::epsilon();
+            const float shrink = 1.0f - 4.0f * std::numeric_limits<float>::epsilon();
+#if defined(__SSE__) || defined(_M_X64)
+            __m128 near = _mm_set1_ps((float)t_min);
+            __m128 far = _mm_set1_ps((float)t_max);
+            for(int a = 0; a < 3; a++){
+                __m128 orig = _mm_set1_ps(query.orig[a]);
+                __m128 inv_dir = _mm_set1_ps(query.inv_dir[a]);
+                __m128 slack = _mm_set1_ps(query.t_slack[a]);
+                __m128 t0 = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.bounds[query.near_plane[a]]), orig), inv_dir);
+                __m128 t1 = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.bounds[query.far_plane[a]]), orig), inv_dir);
+                t0 = _mm_sub_ps(t0, slack);
+                t1 = _mm_add_ps(t1, slack);
+                // with a NaN operand these return the second one, the running bound
+                near = _mm_max_ps(t0, near);
+                far = _mm_min_ps(t1, far);
+            }
+            near = _mm_mul_ps(near, _mm_set1_ps(shrink));
+            far = _mm_mul_ps(far, _mm_set1_ps(widen));
+            _mm_storeu_ps(t_near, near);
+            return _mm_movemask_ps(_mm_cmple_ps(near, far));
+#else
+            int mask = 0;
+            for(int i = 0; i < 4; i++){
+                float near = (float)t_min, far = (float)t_max;
+                for(int a = 0; a < 3; a++){
+                    float t0 = (node.bounds[query.near_plane[a]][i] - query.orig[a]) * query.inv_dir[a] - query.t_slack[a];
+                    float t1 = (node.bounds[query.far_plane[a]][i] - query.orig[a]) * query.inv_dir[a] + query.t_slack[a];
+                    near = t0 > near ? t0 : near;
+                    far = t1 < far ? t1 : far;
+                }
+                near = near * shrink;
+                t_near[i] = near;
+                if(near <= far * widen) mask |= 1 << i;
+            }
+            return mask;
+#endif
+        }
+
+        static float node_area(const linear_bvh_node& node){
+            float dx = node.bounds_max[0] - node.bounds_min[0];
+            float dy = node.bounds_max[1] - node.bounds_min[1];
+            float dz = node.bounds_max[2] - node.bounds_min[2];
+            return dx * dy + dy * dz + dz * dx;
+        }
+
+        uint32_t collapse(const std::vector<linear_bvh_node>& binary, uint32_t root){
+            // up to four binary subtrees become the children of this node, opening the largest
+            // interior one each time
+            uint32_t children[4];
+            int n = 0;
+            if(binary[root].count > 0){
+                children[n++] = root;
+            }else{
+                children[n++] = root + 1;
+                children[n++] = binary[root].offset;
+            }
+
+            while(n < 4){
+                int best = -1;
+                float best_area = -1;
+                for(int i = 0; i < n; i++){
+                    if(binary[children[i]].count > 0) continue;
+                    float area = node_area(binary[children[i]]);
+                    if(area > best_area){
+                        best = i;
+                        best_area = area;
+                    }
+                }
+                if(best < 0) break;
+
+                uint32_t opened = children[best];
+                children[best] = opened + 1;
+                children[n++] = binary[opened].offset;
+            }
+
+            uint32_t index = (uint32_t)nodes.size();
+            nodes.push_back(wide_bvh_node());
+
+            for(int i = 0; i < n; i++){
+                const linear_bvh_node& child = binary[children[i]];
+                uint32_t target = child.count > 0 ? child.offset : collapse(binary, children[i]);
+
+                wide_bvh_node& node = nodes[index];
+                for(int a = 0; a < 3; a++){
+                    node.bounds[a][i] = child.bounds_min[a];
+                    node.bounds[a + 3][i] = child.bounds_max[a];
+                }
+                node.child[i] = target;
+                node.count[i] = child.count;
+            }
+            return index;
+        }
+};
+
+
+// the traversal structure behind linear_bvh and top_level_bvh
+enum class bvh_accelerator { binary, wide };
+
+
+// flat_bvh or wide_bvh over a set of hittables, usable anywhere a bvh_node was
+class linear_bvh : public hittable {
+    public:
+        linear_bvh() {}
+
+        linear_bvh(const hittable_list& list, double time0, double time1, int max_leaf_size = 2,
+                   bvh_accelerator accel = bvh_accelerator::wide)
+        : linear_bvh(list.objects, time0, time1, max_leaf_size, accel) {}
+
+        linear_bvh(const std::vector<shared_ptr<hittable>>& src_objects, double time0, double time1, int max_leaf_size = 2,
+                   bvh_accelerator accel = bvh_accelerator::wide)
+        : objects(src_objects), accelerator(accel) {
+            std::vector<aabb> boxes(objects.size());
+            for(size_t k = 0; k < objects.size(); k++){
+                if(!objects[k]->bounding_box(time0, time1, boxes[k]))
+                    std::cerr << "No bounding box in linear_bvh constructor.\n";
+            }
+            if(accelerator == bvh_accelerator::wide) wide_tree.build(boxes, max_leaf_size);
+            else tree.build(boxes, max_leaf_size);
+        }
+
+        // adopts a tree built earlier over the same objects in the same order (e.g. from a snapshot)
+        linear_bvh(const std::vector<shared_ptr<hittable>>& src_objects, flat_bvh prebuilt)
+        : objects(src_objects), tree(std::move(prebuilt)), accelerator(bvh_accelerator::binary) {}
+
+        // candidates only report a distance and the surface is evaluated once for the closest, as in
+        // hittable_list::hit
+        virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const override {
+            hit_query queries[2];
+            int best = -1;
+            uint32_t closest_prim = 0;
+
+            auto object_hit = [&](uint32_t prim, double& closest){
+                hit_query& query = queries[best == 0 ? 1 : 0];
+                if(!objects[prim]->intersect(r, t_min, closest, query, rec)) return false;
+                best = (int)(&query - queries);
+                closest_prim = prim;
+                closest = query.t;
+                return true;
+            };
+            bool found = accelerator == bvh_accelerator::wide ? wide_tree.traverse(r, t_min, t_max, object_hit)
+                                                              : tree.traverse(r, t_min, t_max, object_hit);
+
+            if(!found) return false;
+            objects[closest_prim]->evaluate_surface(r, queries[best], rec);
+            return true;
+        }
+
+        virtual bool occluded(const ray& r, double t_min, double t_max) const override {
+            auto object_occluded = [&](uint32_t prim){ return objects[prim]->occluded(r, t_min, t_max); };
+            if(accelerator == bvh_accelerator::wide) return wide_tree.any_hit(r, t_min, t_max, object_occluded);
+            return tree.any_hit(r, t_min, t_max, object_occluded);
+        }
+
+        virtual void collect_emitters(const shared_ptr<hittable>&, std::vector<emitter>& out) const override {
+            for(const auto& object : objects) object->collect_emitters(object, out);
+        }
+
+        virtual bool bounding_box(double, double, aabb& output_box) const override {
+            if(accelerator == bvh_accelerator::wide){
+                if(wide_tree.empty()) return false;
+                output_box = wide_tree.bounds();
+                return true;
+            }
+            if(tree.empty()) return false;
+            output_box = tree.bounds();
+            return true;
+        }
+
+    public:
+        std::vector<shared_ptr<hittable>> objects;
+        flat_bvh tree;
+        wide_bvh wide_tree;
+        bvh_accelerator accelerator = bvh_accelerator::binary;
+};
+
+
+/*
+Top level acceleration structure for a whole scene. Nested hittable_lists are flattened so their
+members are sorted into the tree individually, everything with a finite bounding box goes into a
+linear_bvh (meshes keep their own bvh underneath, which makes this the upper of two levels), and the
+few objects without usable bounds are kept aside and tested linearly after the tree.
+*/
+class top_level_bvh : public hittable {
+    public:
+        top_level_bvh() {}
+
+        top_level_bvh(const hittable_list& world, double time0, double time1,
+                      bvh_accelerator accel = bvh_accelerator::wide) {
+            std::vector<shared_ptr<hittable>> bounded;
+            gather(world, time0, time1, bounded);
+            tree = linear_bvh(bounded, time0, time1, 2, accel);
+        }
+
+        virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const override {
+            bool hit_anything = tree.hit(r, t_min, t_max, rec);
+            if(hit_anything) t_max = rec.t;
+
+            for(const auto& object : unbounded){
+                if(object->hit(r, t_min, t_max, rec)){
+                    hit_anything = true;
+                    t_max = rec.t;
+                }
+            }
+
+            return hit_anything;
+        }
+
+        virtual bool occluded(const ray& r, double t_min, double t_max) const override {
+            if(tree.occluded(r, t_min, t_max)) return true;
+            for(const auto& object : unbounded){
+                if(object->occluded(r, t_min, t_max)) return true;
+            }
+            return false;
+        }
+
+        virtual void collect_emitters(const shared_ptr<hittable>&, std::vector<emitter>& out) const override {
+            tree.collect_emitters(nullptr, out);
+            for(const auto& object : unbounded) object->collect_emitters(object, out);
+        }
+
+        virtual bool bounding_box(double time0, double time1, aabb& output_box) const override {
+            if(!unbounded.empty()) return false;
+            return tree.bounding_box(time0, time1, output_box);
+        }
+
+    public:
+        linear_bvh tree;
+        std::vector<shared_ptr<hittable>> unbounded;
+
+    private:
+        void gather(const hittable_list& list, double time0, double time1, std::vector<shared_ptr<hittable>>& bounded){
+            for(const auto& object : list.objects){
+                if(auto nested = std::dynamic_pointer_cast<hittable_list>(object)){
+                    gather(*nested, time0, time1, bounded);
+                    continue;
+                }
+
+                aabb box;
+                bool finite = object->bounding_box(time0, time1, box);
+                for(int a = 0; finite && a < 3; a++){
+                    finite = std::isfinite(box.min()[a]) && std::isfinite(box.max()[a]);
+                }
+
+                if(finite) bounded.push_back(object);
+                else unbounded.push_back(object);
+            }
+        }
+};
 
 
 #endif
\ No newline at end of file
@@ -52,18 +52,22 @@ bool checkerboard::hit(const ray& r, double t_min, double t_max, hit_record& rec
     rec.u = dot(intersection - bottom_left,u) / (square_size * x_squares); 
     rec.v = dot(intersection - bottom_left,v) / (square_size * y_squares);
     if(((int)(dot(intersection - bottom_left,u)/square_size) + (int)(dot(intersection - bottom_left,v) / square_size) % 2) %2 ){
-        rec.mat_ptr = b_ptr;
+        rec.mat_ptr = b_ptr.get();
     }else{
-        rec.mat_ptr = w_ptr;
+        rec.mat_ptr = w_ptr.get();
     }
 
-    // rec.mat_ptr = b_ptr;
+    // rec.mat_ptr = b_ptr.get();
 
     return true;
 }
 
 bool checkerboard::bounding_box(double time0, double time1, aabb& output_box) const{
-    output_box = aabb(bottom_left -  normal * depth, bottom_left + u * x_squares * square_size + v * y_squares * square_size);
+    // u and v can point down an axis, so take the componentwise extremes of the padded corners
+    point3 a = bottom_left - normal * depth;
+    point3 b = top_right + normal * depth;
+    output_box = aabb(point3(fmin(a.x(), b.x()), fmin(a.y(), b.y()), fmin(a.z(), b.z())),
+                      point3(fmax(a.x(), b.x()), fmax(a.y(), b.y()), fmax(a.z(), b.z())));
     return true;
 }
 
@@ -42,6 +42,13 @@ vec3 srgb_to_linear(color c){
 
 
 
+// gamma 2 encoding of a pixel's mean color into 8 bit rgb, same mapping as write_color
+inline void color_to_rgb8(const color& mean_color, unsigned char* rgb){
+    for(int c = 0; c < 3; c++){
+        rgb[c] = static_cast<unsigned char>(256 * clamp(sqrt(fmax(mean_color[c], 0.0)), 0, 0.999));
+    }
+}
+
 void write_color(std::ostream &out, color pixel_color, int samples_per_pixel) { 
     auto scale = 1.0 / samples_per_pixel;
     
@@ -96,7 +96,7 @@ bool constant_medium::hit(const ray& r, double t_min, double t_max, hit_record&
 
     rec.normal = vec3(1,0,0);
     rec.front_face = true;
-    rec.mat_ptr = phase_function;
+    rec.mat_ptr = phase_function.get();
     // std::cerr<<"solid hit"<<'\n'; 
     return true;
 
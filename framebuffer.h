@@ -0,0 +1,27 @@
+#ifndef FRAMEBUFFER_H
+#define FRAMEBUFFER_H
+
+#include <vector>
+
+#include "vec3.h"
+
+
+// linear (pre gamma) pixel values shared by all render threads. every pixel belongs to exactly one tile,
+// so threads never write the same pixel and no locking is needed on the pixels themselves.
+// rows are indexed bottom to top (j = 0 is the bottom scanline) to match the camera's v coordinate
+class framebuffer {
+    public:
+        framebuffer() : width(0), height(0) {}
+        framebuffer(int w, int h) : width(w), height(h), pixels(w * h) {}
+
+        color& at(int i, int j) { return pixels[j * width + i]; }
+        const color& at(int i, int j) const { return pixels[j * width + i]; }
+
+    public:
+        int width;
+        int height;
+        std::vector<color> pixels;
+};
+
+
+#endif
@@ -2,6 +2,12 @@
 #define HITTABLE_H
 
 #include "aabb.h"
+#include "mat4.h"
+
+#include <memory>
+#include <cstdint>
+#include <vector>
+#include <cmath>
 
 class material;
 
@@ -12,7 +18,9 @@ struct hit_record{
     double u;
     double v;
     double pdf; // pdf of BRDF
-    shared_ptr<material> mat_ptr;
+    // non-owning, materials are owned by the primitives (and so the scene) that reference them.
+    // a raw pointer keeps hit_record copies free of atomic refcount traffic
+    const material* mat_ptr;
     bool front_face;
 
     inline void set_face_normal(const ray& r, const vec3& outward_normal){
@@ -21,6 +29,24 @@ struct hit_record{
     }
 };
 
+// the cheap first half of a hit: its distance plus whatever the primitive needs to finish it later
+// (barycentrics, a face or lane index)
+struct hit_query {
+    double t;
+    double u, v;
+    uint32_t id;
+    uint32_t part;
+};
+
+class hittable;
+
+// a light found in the scene: a shape that can be sampled (pdf_value and random) and a rough estimate
+// of the power it gives off, used to pick between lights
+struct emitter {
+    shared_ptr<hittable> shape;
+    double power;
+};
+
 class hittable{
     /*
         const = 0 note: A virtual function in a class makes it a POLYMORPHIC base class, where as a 
@@ -54,13 +80,50 @@ class hittable{
     public:
         virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const = 0;
         virtual bool bounding_box(double time0, double time1, aabb& output_box) const = 0;
-        virtual double pdf_value(const point3& p, const vec3& v) const{
+
+        // hit() split in two, for aggregates that test many candidates: intersect() only finds the
+        // distance, and evaluate_surface() fills in point, normal, uvs and material for the one
+        // candidate that ends up closest. rec is the record the caller will finally evaluate into,
+        // the same one for every candidate: objects without a split (the defaults) hit() straight into
+        // it and have nothing left to evaluate. that relies on hit() leaving rec alone on a miss, and
+        // on every candidate after a hit being closer, so the last record written is the closest
+        virtual bool intersect(const ray& r, double t_min, double t_max, hit_query& query, hit_record& rec) const {
+            if(!hit(r, t_min, t_max, rec)) return false;
+            query.t = rec.t;
+            return true;
+        }
+        virtual void evaluate_surface(const ray&, const hit_query&, hit_record&) const {}
+
+        // whether anything blocks r within [t_min, t_max], for shadow rays and other visibility tests.
+        // any hit will do, so aggregates stop at the first one and nothing about the surface is
+        // evaluated. the default asks intersect()
+        virtual bool occluded(const ray& r, double t_min, double t_max) const {
+            hit_query query;
+            hit_record rec;
+            return intersect(r, t_min, t_max, query, rec);
+        }
+
+        virtual double pdf_value(const point3&, const vec3&) const{
             return 0.0;
         }
-        virtual vec3 random(const vec3& o) const {
+        virtual vec3 random(const vec3&) const {
             return vec3(1,0,0);
         }
 
+        // appends the emitting surfaces of this object to out, self being the pointer the object is
+        // held by. containers recurse and wrappers wrap what their child reports, so the emitters
+        // come out as they sit in world space. objects that cannot be sampled add nothing
+        virtual void collect_emitters(const shared_ptr<hittable>&, std::vector<emitter>&) const {}
+
+    protected:
+        // hit() for objects that override the split pair
+        bool deferred_hit(const ray& r, double t_min, double t_max, hit_record& rec) const {
+            hit_query query;
+            if(!intersect(r, t_min, t_max, query, rec)) return false;
+            evaluate_surface(r, query, rec);
+            return true;
+        }
+
 
 
         
@@ -75,364 +138,184 @@ class flip_face : public hittable {
 
         virtual bool hit(
             const ray& r, double t_min, double t_max, hit_record& rec) const override {
+            return deferred_hit(r, t_min, t_max, rec);
+        }
 
-            if (!ptr->hit(r, t_min, t_max, rec))
-                return false;
+        virtual bool intersect(const ray& r, double t_min, double t_max, hit_query& query, hit_record& rec) const override {
+            return ptr->intersect(r, t_min, t_max, query, rec);
+        }
 
+        virtual void evaluate_surface(const ray& r, const hit_query& query, hit_record& rec) const override {
+            ptr->evaluate_surface(r, query, rec);
             rec.front_face = !rec.front_face;
-            return true;
         }
 
-        virtual bool bounding_box(double time0, double time1, aabb& output_box) const override {
-            return ptr->bounding_box(time0, time1, output_box);
+        virtual bool occluded(const ray& r, double t_min, double t_max) const override {
+            return ptr->occluded(r, t_min, t_max);
         }
 
-    public:
-        shared_ptr<hittable> ptr;
-};
-
-
-
-class translate : public hittable {
-    public:
-        translate(shared_ptr<hittable> p, const vec3& displacement) : ptr(p), offset(displacement) {}
-
-        virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const override;
-
-        virtual bool bounding_box(double time0, double time1, aabb& output_box) const override;
-
-    public:
-        shared_ptr<hittable> ptr;
-        vec3 offset;
-};
-
-class scale : public hittable {
-    public:
-        scale(shared_ptr<hittable> p, double s);
-        
-         virtual bool hit(
-            const ray& r, double t_min, double t_max, hit_record& rec) const override;
-
         virtual bool bounding_box(double time0, double time1, aabb& output_box) const override {
-            output_box = bbox;
-            return hasbox;
+            return ptr->bounding_box(time0, time1, output_box);
         }
 
-    public:
-        shared_ptr<hittable> ptr;
-        double scaling;
-        bool hasbox;
-        aabb bbox;
-
-};
-
-class rotate_y : public hittable {
-    public:
-        rotate_y(shared_ptr<hittable> p, double angle);
-
-        virtual bool hit(
-            const ray& r, double t_min, double t_max, hit_record& rec) const override;
-
-        virtual bool bounding_box(double time0, double time1, aabb& output_box) const override {
-            output_box = bbox;
-            return hasbox;
+        // flipping changes which side faces the ray, not where the surface is, so a flipped light
+        // samples like the original
+        virtual double pdf_value(const point3& o, const vec3& v) const override {
+            return ptr->pdf_value(o, v);
         }
 
-    public:
-        shared_ptr<hittable> ptr;
-        double sin_theta;
-        double cos_theta;
-        bool hasbox;
-        aabb bbox;
-};
-
-class rotate_z : public hittable
-{
-    public:
-        rotate_z(shared_ptr<hittable> p, double angle);
-
-        virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const override;
-
-        virtual bool bounding_box(double time0, double time1, aabb& output_box) const override {
-            output_box = bbox;
-            return hasbox;
+        virtual vec3 random(const point3& o) const override {
+            return ptr->random(o);
         }
 
-    public:
-        shared_ptr<hittable> ptr;
-        double sin_theta;
-        double cos_theta;
-        bool hasbox;
-        aabb bbox;
-};
-
-
-class rotate_x : public hittable
-{
-    public:
-        rotate_x(shared_ptr<hittable> p, double angle);
-
-        virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const override;
-
-        virtual bool bounding_box(double time0, double time1, aabb& output_box) const override {
-            output_box = bbox;
-            return hasbox;
+        virtual void collect_emitters(const shared_ptr<hittable>&, std::vector<emitter>& out) const override {
+            size_t first = out.size();
+            ptr->collect_emitters(ptr, out);
+            for(size_t k = first; k < out.size(); k++) out[k].shape = make_shared<flip_face>(out[k].shape);
         }
 
     public:
         shared_ptr<hittable> ptr;
-        double sin_theta;
-        double cos_theta;
-        bool hasbox;
-        aabb bbox;
 };
 
 
 
-scale::scale(shared_ptr<hittable> p, double s) : scaling(s), ptr(p)
-{
-    hasbox = p->bounding_box(0, 1, bbox);
-    bbox.minimum = bbox.minimum * scaling;
-    bbox.maximum = bbox.maximum * scaling;
-}
-
-bool scale::hit(const ray& r, double t_min, double t_max, hit_record& rec) const {
-    auto origin = r.origin();
-    origin[0] = origin[0] / scaling;
-    origin[1] = origin[1] / scaling;
-    origin[2] = origin[2] / scaling;
-    
-    ray scaled_r(origin, r.direction(), r.time());
-
-    if(!ptr->hit(scaled_r, t_min, t_max, rec)) return false;
-
-    rec.p *= scaling;
-    
-    return true;
-
-    
-
-}
-
-rotate_x::rotate_x(shared_ptr<hittable> p, double angle) : ptr(p) {
-    auto radians = degrees_to_radians(angle);
-    sin_theta = sin(radians);
-    cos_theta = cos(radians);
-    hasbox = ptr->bounding_box(0, 1, bbox);
-
-    point3 min( infinity,  infinity,  infinity);
-    point3 max(-infinity, -infinity, -infinity);
-
-    vec3 test_vector(0,0,0);
-
-    for(int i  = 0; i < 2; i++){
-        for(int j = 0; j < 2; j++){
-            for(int k = 0; k < 2; k ++){
-                auto x = (1 - i) * bbox.min()[0] + i * bbox.max()[0];
-                auto y = (1 - j) * bbox.min()[1] + j * bbox.max()[1];
-                auto z = (1 - k) * bbox.min()[2] + k * bbox.max()[2];
-
-                test_vector[0] = x * cos_theta + y * sin_theta;
-                test_vector[1] = y * cos_theta - x * sin_theta;
-
-                for(int l = 0; l < 3; l++){
-                    min[l] = fmin(min[l], test_vector[l]);
-                    max[l] = fmax(max[l], test_vector[l]); 
-                }
-
+/*
+Affine instance transform. The matrix maps the child's object space into world space; rays are
+brought into object space with the inverse (direction included, so t means the same thing on both
+sides) and hit normals are carried back with the normal matrix, the transposed inverse.
+Wrapping a transform in another one folds both into a single matrix around the original child, so
+a rotate_y -> rotate_z -> rotate_y -> scale -> translate chain costs one ray transform per test.
+*/
+class transform : public hittable {
+    public:
+        transform(shared_ptr<hittable> p, const mat4& m) : ptr(p), object_to_world(m) {
+            if(auto inner = std::dynamic_pointer_cast<transform>(p)){
+                ptr = inner->ptr;
+                object_to_world = m * inner->object_to_world;
             }
+            world_to_object = object_to_world.inverse();
+            normal_matrix = world_to_object.transposed_linear();
         }
-    }
-
-    bbox = aabb(min, max);
-}
-
 
+        virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const override {
+            return deferred_hit(r, t_min, t_max, rec);
+        }
 
-rotate_y::rotate_y(shared_ptr<hittable> p, double angle) : ptr(p) {
-    auto radians = degrees_to_radians(angle);
-    sin_theta = sin(radians);
-    cos_theta = cos(radians);
-    hasbox = ptr->bounding_box(0, 1, bbox);
+        // a child without a split leaves an object space record in rec, which evaluate_surface then
+        // carries into world space like any other
+        virtual bool intersect(const ray& r, double t_min, double t_max, hit_query& query, hit_record& rec) const override {
+            return ptr->intersect(to_object(r), t_min, t_max, query, rec);
+        }
 
-    point3 min( infinity,  infinity,  infinity);
-    point3 max(-infinity, -infinity, -infinity);
+        virtual void evaluate_surface(const ray& r, const hit_query& query, hit_record& rec) const override {
+            ptr->evaluate_surface(to_object(r), query, rec);
 
-    for (int i = 0; i < 2; i++) {
-        for (int j = 0; j < 2; j++) {
-            for (int k = 0; k < 2; k++) {
-                auto x = i*bbox.max().x() + (1-i)*bbox.min().x();
-                auto y = j*bbox.max().y() + (1-j)*bbox.min().y();
-                auto z = k*bbox.max().z() + (1-k)*bbox.min().z();
+            // the child already oriented the normal against the ray, and a linear map keeps the sign of
+            // dot(direction, normal), so front_face carries over unchanged
+            rec.p = object_to_world.transform_point(rec.p);
+            rec.normal = unit_vector(normal_matrix.transform_vector(rec.normal));
+        }
 
-                auto newx =  cos_theta*x + sin_theta*z;
-                auto newz = -sin_theta*x + cos_theta*z;
+        virtual bool occluded(const ray& r, double t_min, double t_max) const override {
+            return ptr->occluded(to_object(r), t_min, t_max);
+        }
 
-                vec3 tester(newx, y, newz);
+        // tight box around the eight transformed corners of the child's box
+        virtual bool bounding_box(double time0, double time1, aabb& output_box) const override {
+            aabb box;
+            if(!ptr->bounding_box(time0, time1, box)){
+                return false;
+            }
 
-                for (int c = 0; c < 3; c++) {
-                    min[c] = fmin(min[c], tester[c]);
-                    max[c] = fmax(max[c], tester[c]);
+            point3 min( infinity,  infinity,  infinity);
+            point3 max(-infinity, -infinity, -infinity);
+
+            for(int i = 0; i < 2; i++){
+                for(int j = 0; j < 2; j++){
+                    for(int k = 0; k < 2; k++){
+                        point3 corner(i ? box.max().x() : box.min().x(),
+                                      j ? box.max().y() : box.min().y(),
+                                      k ? box.max().z() : box.min().z());
+                        point3 tester = object_to_world.transform_point(corner);
+
+                        for(int c = 0; c < 3; c++){
+                            min[c] = fmin(min[c], tester[c]);
+                            max[c] = fmax(max[c], tester[c]);
+                        }
+                    }
                 }
             }
-        }
-    }
-
-    bbox = aabb(min, max);
-}
-
-rotate_z::rotate_z(shared_ptr<hittable> p, double angle) : ptr(p) {
-    auto radians = degrees_to_radians(angle);
-    sin_theta = sin(radians);
-    cos_theta = cos(radians);
-    hasbox = ptr->bounding_box(0, 1, bbox);
-
-    point3 min( infinity,  infinity,  infinity);
-    point3 max(-infinity, -infinity, -infinity);
-
-    vec3 test_vector(0,0,0);
 
-    for(int i  = 0; i < 2; i++){
-        for(int j = 0; j < 2; j++){
-            for(int k = 0; k < 2; k ++){
-                auto x = (1 - i) * bbox.min()[0] + i * bbox.max()[0];
-                auto y = (1 - j) * bbox.min()[1] + j * bbox.max()[1];
-                auto z = (1 - k) * bbox.min()[2] + k * bbox.max()[2];
+            output_box = aabb(min, max);
+            return true;
+        }
 
-                test_vector[0] = y * cos_theta + z * sin_theta;
-                test_vector[1] = z * cos_theta - y * sin_theta;
+        // the child samples in object space. normalizing the mapped direction changes densities by
+        // |det L| / |L w|^3 for a unit w and L the linear part of world_to_object, which is 1 for
+        // rotations and translations
+        virtual double pdf_value(const point3& o, const vec3& v) const override {
+            vec3 local = world_to_object.transform_vector(unit_vector(v));
+            double length = local.length();
+            double jacobian = fabs(world_to_object.linear_determinant()) / (length * length * length);
+            return ptr->pdf_value(world_to_object.transform_point(o), local) * jacobian;
+        }
 
-                for(int l = 0; l < 3; l++){
-                    min[l] = fmin(min[l], test_vector[l]);
-                    max[l] = fmax(max[l], test_vector[l]); 
-                }
+        virtual vec3 random(const point3& o) const override {
+            return object_to_world.transform_vector(ptr->random(world_to_object.transform_point(o)));
+        }
 
+        // areas scale by about the two thirds power of the volume factor
+        virtual void collect_emitters(const shared_ptr<hittable>&, std::vector<emitter>& out) const override {
+            size_t first = out.size();
+            ptr->collect_emitters(ptr, out);
+            double area_scale = pow(fabs(object_to_world.linear_determinant()), 2.0 / 3);
+            for(size_t k = first; k < out.size(); k++){
+                out[k].shape = make_shared<transform>(out[k].shape, object_to_world);
+                out[k].power *= area_scale;
             }
         }
-    }
-
-    bbox = aabb(min, max);
-}
-
-
-
-bool rotate_x::hit(const ray& r, double t_min, double t_max, hit_record& rec) const{
-    auto origin = r.origin();
-    auto direction = r.direction();
-
-    origin[1] = r.origin()[1] * cos_theta + r.origin()[2] * sin_theta;
-    origin[2] = r.origin()[2] * cos_theta - r.origin()[1] * sin_theta;
-
-    direction[1] = r.direction()[1] * cos_theta + r.direction()[2] * sin_theta;
-    direction[2] = r.direction()[2] * cos_theta - r.direction()[1] * sin_theta;
-
-    ray rotated_r(origin, direction, r.time());
-
-    if(!ptr->hit(rotated_r, t_min, t_max, rec)){
-        return false;
-    }
-
-    auto p = rec.p;
-    auto normal = rec.normal;
-
-    p[1] = rec.p[1] * cos_theta - rec.p[2] * sin_theta;
-    p[2] = rec.p[2] * cos_theta + rec.p[1] * sin_theta;
-
-    normal[1] = rec.normal[1] * cos_theta - rec.normal[2] * sin_theta;
-    normal[2] = rec.normal[2] * cos_theta + rec.normal[1] * sin_theta;
-
-    rec.p = p;
-    rec.set_face_normal(rotated_r, normal);
 
-    return true;
-
-}
-
-bool rotate_y::hit(const ray& r, double t_min, double t_max, hit_record& rec) const {
-    auto origin = r.origin();
-    auto direction = r.direction();
-
-    origin[0] = cos_theta*r.origin()[0] - sin_theta*r.origin()[2];
-    origin[2] = sin_theta*r.origin()[0] + cos_theta*r.origin()[2];
-
-    direction[0] = cos_theta*r.direction()[0] - sin_theta*r.direction()[2];
-    direction[2] = sin_theta*r.direction()[0] + cos_theta*r.direction()[2];
-
-    ray rotated_r(origin, direction, r.time());
-
-    if (!ptr->hit(rotated_r, t_min, t_max, rec))
-        return false;
-
-    auto p = rec.p;
-    auto normal = rec.normal;
-
-    p[0] =  cos_theta*rec.p[0] + sin_theta*rec.p[2];
-    p[2] = -sin_theta*rec.p[0] + cos_theta*rec.p[2];
-
-    normal[0] =  cos_theta*rec.normal[0] + sin_theta*rec.normal[2];
-    normal[2] = -sin_theta*rec.normal[0] + cos_theta*rec.normal[2];
-
-    rec.p = p;
-    rec.set_face_normal(rotated_r, normal);
-
-    return true;
-}
-
-bool rotate_z::hit(const ray& r, double t_min, double t_max, hit_record& rec) const{
-    auto origin = r.origin();
-    auto direction = r.direction();
-
-    origin[0] = r.origin()[0] * cos_theta + r.origin()[1] * sin_theta;
-    origin[1] = r.origin()[1] * cos_theta - r.origin()[0] * sin_theta;
-
-    direction[0] = r.direction()[0] * cos_theta + r.direction()[1] * sin_theta;
-    direction[1] = r.direction()[1] * cos_theta - r.direction()[0] * sin_theta;
-
-    ray rotated_r(origin, direction, r.time());
-
-    if(!ptr->hit(rotated_r, t_min, t_max, rec)){
-        return false;
-    }
-
-    auto p = rec.p;
-    auto normal = rec.normal;
-
-    p[0] = rec.p[0] * cos_theta - rec.p[1] * sin_theta;
-    p[1] = rec.p[1] * cos_theta + rec.p[0] * sin_theta;
-
-    normal[0] = rec.normal[0] * cos_theta - rec.normal[1] * sin_theta;
-    normal[1] = rec.normal[1] * cos_theta + rec.normal[0] * sin_theta;
-
-    rec.p = p;
-    rec.set_face_normal(rotated_r, normal);
-
-    return true;
-
-}
+    public:
+        shared_ptr<hittable> ptr;
+        mat4 object_to_world;
+        mat4 world_to_object;
+        mat4 normal_matrix;
 
-bool translate::hit(const ray& r, double t_min, double t_max, hit_record& rec) const {
-    ray moved_r(r.origin() - offset, r.direction(), r.time());
-    if(!ptr->hit(moved_r, t_min, t_max, rec)){
-        return false;
-    }
+    private:
+        ray to_object(const ray& r) const {
+            return ray(world_to_object.transform_point(r.origin()), world_to_object.transform_vector(r.direction()), r.time());
+        }
+};
 
-    rec.p += offset;
-    rec.set_face_normal(moved_r, rec.normal);
 
-    return true;
-}
+// the usual instance wrappers, each one is just a transform with the matching matrix
 
-bool translate::bounding_box(double time0, double time1, aabb& output_box) const {
-    if(!ptr -> bounding_box(time0, time1, output_box)){
-        return false;
-    }
+class translate : public transform {
+    public:
+        translate(shared_ptr<hittable> p, const vec3& displacement) : transform(p, mat4::translation(displacement)) {}
+};
 
-    output_box = aabb(output_box.min() + offset, output_box.max() + offset);
-    return true;
-}
+class scale : public transform {
+    public:
+        scale(shared_ptr<hittable> p, double s) : transform(p, mat4::scaling(vec3(s, s, s))) {}
+        scale(shared_ptr<hittable> p, const vec3& s) : transform(p, mat4::scaling(s)) {}
+};
 
+class rotate_x : public transform {
+    public:
+        rotate_x(shared_ptr<hittable> p, double angle) : transform(p, mat4::rotation_x(angle)) {}
+};
 
+class rotate_y : public transform {
+    public:
+        rotate_y(shared_ptr<hittable> p, double angle) : transform(p, mat4::rotation_y(angle)) {}
+};
 
+class rotate_z : public transform {
+    public:
+        rotate_z(shared_ptr<hittable> p, double angle) : transform(p, mat4::rotation_z(angle)) {}
+};
 
 
 #endif
\ No newline at end of file
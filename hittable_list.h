@@ -20,6 +20,11 @@ class hittable_list : public hittable {
 
         virtual bool hit(
                         const ray& r, double t_min, double t_max, hit_record& h) const override;
+        virtual bool occluded(const ray& r, double t_min, double t_max) const override;
+
+        virtual void collect_emitters(const shared_ptr<hittable>&, std::vector<emitter>& out) const override {
+            for(const auto& object : objects) object->collect_emitters(object, out);
+        }
         
         virtual bool bounding_box(double time0, double time1, aabb& bounding_box) const override;
 
@@ -30,20 +35,33 @@ class hittable_list : public hittable {
 
 
 bool hittable_list::hit(const ray& r, double t_min, double t_max, hit_record& rec) const {
-    hit_record temp_rec;
-    bool hit_anything  = false;
+    // candidates only report a distance, the surface is evaluated once for the closest. the two
+    // queries take turns so the best one so far is never overwritten or copied
+    hit_query queries[2];
+    int best = -1;
+    const hittable* closest_object = nullptr;
     auto closest_so_far = t_max;
 
     for(const auto& object : objects){
-        if(object->hit(r, t_min, closest_so_far, temp_rec)){
-            hit_anything = true;           
-            closest_so_far = temp_rec.t;
-            rec = temp_rec;
-        
+        hit_query& query = queries[best == 0 ? 1 : 0];
+        if(object->intersect(r, t_min, closest_so_far, query, rec)){
+            best = (int)(&query - queries);
+            closest_object = object.get();
+            closest_so_far = query.t;
         }
     }
 
-    return hit_anything;
+    if(best < 0) return false;
+    closest_object->evaluate_surface(r, queries[best], rec);
+    return true;
+}
+
+
+bool hittable_list::occluded(const ray& r, double t_min, double t_max) const {
+    for(const auto& object : objects){
+        if(object->occluded(r, t_min, t_max)) return true;
+    }
+    return false;
 }
 
 
@@ -0,0 +1,395 @@
+#ifndef IMAGE_WRITER_H
+#define IMAGE_WRITER_H
+
+#include <vector>
+#include <deque>
+#include <algorithm>
+#include <string>
+#include <fstream>
+#include <iostream>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdlib>
+
+#include "rtweekend.h"
+#include "color.h"
+#include "framebuffer.h"
+
+
+// .ppm reference http://netpbm.sourceforge.net/doc/ppm.html
+// .pfm reference http://www.pauldebevec.com/Research/HDR/PFM/
+// .png reference https://www.w3.org/TR/png/ and deflate https://www.rfc-editor.org/rfc/rfc1951
+
+
+// binary (P6) ppm, gamma encoded the same way as write_color
+void write_ppm(std::ostream& out, const framebuffer& fb){
+    out << "P6\n" << fb.width << ' ' << fb.height << "\n255\n";
+
+    std::vector<unsigned char> row(3 * fb.width);
+    for(int j = fb.height - 1; j >= 0; j--){
+        for(int i = 0; i < fb.width; i++){
+            color_to_rgb8(fb.at(i, j), &row[3 * i]);
+        }
+        out.write(reinterpret_cast<const char*>(row.data()), row.size());
+    }
+}
+
+// linear float pfm. scanlines are stored bottom to top, which is how the framebuffer already keeps them.
+// a negative scale marks little endian data
+void write_pfm(std::ostream& out, const framebuffer& fb){
+    const uint16_t probe = 1;
+    bool little_endian = *reinterpret_cast<const unsigned char*>(&probe) == 1;
+    out << "PF\n" << fb.width << ' ' << fb.height << '\n' << (little_endian ? "-1.0" : "1.0") << '\n';
+
+    std::vector<float> row(3 * fb.width);
+    for(int j = 0; j < fb.height; j++){
+        for(int i = 0; i < fb.width; i++){
+            for(int c = 0; c < 3; c++){
+                row[3 * i + c] = static_cast<float>(fb.at(i, j)[c]);
+            }
+        }
+        out.write(reinterpret_cast<const char*>(row.data()), row.size() * sizeof(float));
+    }
+}
+
+
+/*
+Minimal zlib/deflate encoder for png output. Uses one block of fixed huffman codes with
+hash chain LZ77 matching, which gets most of the way to zlib's ratio on rendered images
+without pulling in a library.
+*/
+class deflate_encoder {
+    public:
+        static std::vector<unsigned char> zlib_compress(const std::vector<unsigned char>& data){
+            deflate_encoder enc;
+            enc.out.push_back(0x78); // 32K window, deflate
+            enc.out.push_back(0x01); // no preset dictionary, fastest compression level (header checksum)
+
+            enc.put_bits(1, 1); // final block
+            enc.put_bits(1, 2); // fixed huffman codes
+            enc.compress(data);
+            enc.put_literal(256); // end of block
+            enc.flush_bits();
+
+            uint32_t a = adler32(data);
+            for(int shift = 24; shift >= 0; shift -= 8){
+                enc.out.push_back((a >> shift) & 0xff);
+            }
+
+            return enc.out;
+        }
+
+    private:
+        static const int window_size = 32768;
+        static const int hash_size = 1 << 15;
+        static const int max_chain = 64;
+        static const int min_match = 3;
+        static const int max_match = 258;
+
+        std::vector<unsigned char> out;
+        uint32_t bit_buffer = 0;
+        int bit_count = 0;
+
+        void put_bits(uint32_t bits, int count){
+            bit_buffer |= bits << bit_count;
+            bit_count += count;
+            while(bit_count >= 8){
+                out.push_back(bit_buffer & 0xff);
+                bit_buffer >>= 8;
+                bit_count -= 8;
+            }
+        }
+
+        // huffman codes are packed starting from their most significant bit
+        void put_code(uint32_t code, int length){
+            uint32_t reversed = 0;
+            for(int k = 0; k < length; k++){
+                reversed = (reversed << 1) | (code & 1);
+                code >>= 1;
+            }
+            put_bits(reversed, length);
+        }
+
+        void flush_bits(){
+            if(bit_count > 0) out.push_back(bit_buffer & 0xff);
+            bit_buffer = 0;
+            bit_count = 0;
+        }
+
+        void put_literal(int symbol){
+            if(symbol < 144)      put_code(0x30 + symbol, 8);
+            else if(symbol < 256) put_code(0x190 + symbol - 144, 9);
+            else if(symbol < 280) put_code(symbol - 256, 7);
+            else                  put_code(0xc0 + symbol - 280, 8);
+        }
+
+        void put_match(int length, int distance){
+            static const int length_base[29] = {3,4,5,6,7,8,9,10,11,13,15,17,19,23,27,31,35,43,51,59,67,83,99,115,131,163,195,227,258};
+            static const int length_extra[29] = {0,0,0,0,0,0,0,0,1,1,1,1,2,2,2,2,3,3,3,3,4,4,4,4,5,5,5,5,0};
+            static const int dist_base[30] = {1,2,3,4,5,7,9,13,17,25,33,49,65,97,129,193,257,385,513,769,1025,1537,2049,3073,4097,6145,8193,12289,16385,24577};
+            static const int dist_extra[30] = {0,0,0,0,1,1,2,2,3,3,4,4,5,5,6,6,7,7,8,8,9,9,10,10,11,11,12,12,13,13};
+
+            int l = 28;
+            while(length_base[l] > length) l--;
+            put_literal(257 + l);
+            put_bits(length - length_base[l], length_extra[l]);
+
+            int d = 29;
+            while(dist_base[d] > distance) d--;
+            put_code(d, 5);
+            put_bits(distance - dist_base[d], dist_extra[d]);
+        }
+
+        void compress(const std::vector<unsigned char>& data){
+            const int n = (int)data.size();
+            std::vector<int> head(hash_size, -1);
+            std::vector<int> prev(window_size, -1);
+
+            auto hash = [&](int pos){
+                return ((data[pos] << 10) ^ (data[pos + 1] << 5) ^ data[pos + 2]) & (hash_size - 1);
+            };
+            auto insert = [&](int pos){
+                if(pos + min_match > n) return;
+                int h = hash(pos);
+                prev[pos & (window_size - 1)] = head[h];
+                head[h] = pos;
+            };
+
+            int i = 0;
+            while(i < n){
+                int best_length = 0;
+                int best_distance = 0;
+
+                if(i + min_match <= n){
+                    int candidate = head[hash(i)];
+                    int limit = std::min(max_match, n - i);
+                    for(int chain = 0; candidate >= 0 && i - candidate <= window_size && chain < max_chain; chain++){
+                        int length = 0;
+                        while(length < limit && data[candidate + length] == data[i + length]) length++;
+                        if(length > best_length){
+                            best_length = length;
+                            best_distance = i - candidate;
+                            if(length == limit) break;
+                        }
+                        candidate = prev[candidate & (window_size - 1)];
+                    }
+                }
+
+                if(best_length >= min_match){
+                    put_match(best_length, best_distance);
+                    for(int k = 0; k < best_length; k++) insert(i + k);
+                    i += best_length;
+                }else{
+                    put_literal(data[i]);
+                    insert(i);
+                    i++;
+                }
+            }
+        }
+
+        static uint32_t adler32(const std::vector<unsigned char>& data){
+            uint32_t a = 1, b = 0;
+            for(unsigned char byte : data){
+                a = (a + byte) % 65521;
+                b = (b + a) % 65521;
+            }
+            return (b << 16) | a;
+        }
+};
+
+
+inline uint32_t png_crc(const unsigned char* buf, size_t len, uint32_t crc = 0xffffffffu){
+    // built once, thread safe by the rules of static local initialization
+    static const std::vector<uint32_t> table = []{
+        std::vector<uint32_t> t(256);
+        for(uint32_t n = 0; n < 256; n++){
+            uint32_t c = n;
+            for(int k = 0; k < 8; k++) c = (c & 1) ? 0xedb88320u ^ (c >> 1) : c >> 1;
+            t[n] = c;
+        }
+        return t;
+    }();
+
+    for(size_t k = 0; k < len; k++){
+        crc = table[(crc ^ buf[k]) & 0xff] ^ (crc >> 8);
+    }
+    return crc;
+}
+
+inline void png_chunk(std::ostream& out, const char* type, const std::vector<unsigned char>& data){
+    std::vector<unsigned char> buf;
+    uint32_t len = (uint32_t)data.size();
+    for(int shift = 24; shift >= 0; shift -= 8) buf.push_back((len >> shift) & 0xff);
+    buf.insert(buf.end(), type, type + 4);
+    buf.insert(buf.end(), data.begin(), data.end());
+
+    uint32_t crc = png_crc(buf.data() + 4, buf.size() - 4) ^ 0xffffffffu;
+    for(int shift = 24; shift >= 0; shift -= 8) buf.push_back((crc >> shift) & 0xff);
+
+    out.write(reinterpret_cast<const char*>(buf.data()), buf.size());
+}
+
+// 8 bit rgb png. each scanline picks the filter with the smallest sum of absolute residuals
+void write_png(std::ostream& out, const framebuffer& fb){
+    const int stride = 3 * fb.width;
+    std::vector<unsigned char> prior(stride, 0), current(stride);
+    std::vector<unsigned char> filtered;
+    filtered.reserve((size_t)(stride + 1) * fb.height);
+
+    std::vector<unsigned char> candidate[5];
+    for(auto& c : candidate) c.resize(stride);
+
+    for(int j = fb.height - 1; j >= 0; j--){
+        for(int i = 0; i < fb.width; i++){
+            color_to_rgb8(fb.at(i, j), &current[3 * i]);
+        }
+
+        int best = 0;
+        long best_cost = -1;
+        for(int type = 0; type < 5; type++){
+            long cost = 0;
+            for(int k = 0; k < stride; k++){
+                int a = k >= 3 ? current[k - 3] : 0;
+                int b = prior[k];
+                int c = k >= 3 ? prior[k - 3] : 0;
+                int predictor = 0;
+                switch(type){
+                    case 1: predictor = a; break;
+                    case 2: predictor = b; break;
+                    case 3: predictor = (a + b) / 2; break;
+                    case 4: {
+                        int p = a + b - c;
+                        int pa = abs(p - a), pb = abs(p - b), pc = abs(p - c);
+                        predictor = (pa <= pb && pa <= pc) ? a : (pb <= pc ? b : c);
+                        break;
+                    }
+                }
+                unsigned char residual = (unsigned char)(current[k] - predictor);
+                candidate[type][k] = residual;
+                cost += residual < 128 ? residual : 256 - residual;
+            }
+            if(best_cost < 0 || cost < best_cost){
+                best_cost = cost;
+                best = type;
+            }
+        }
+
+        filtered.push_back((unsigned char)best);
+        filtered.insert(filtered.end(), candidate[best].begin(), candidate[best].end());
+        std::swap(prior, current);
+    }
+
+    static const unsigned char signature[8] = {137, 80, 78, 71, 13, 10, 26, 10};
+    out.write(reinterpret_cast<const char*>(signature), 8);
+
+    std::vector<unsigned char> header;
+    for(uint32_t v : {(uint32_t)fb.width, (uint32_t)fb.height}){
+        for(int shift = 24; shift >= 0; shift -= 8) header.push_back((v >> shift) & 0xff);
+    }
+    header.insert(header.end(), {8, 2, 0, 0, 0}); // 8 bit depth, rgb, deflate, adaptive filtering, no interlace
+
+    png_chunk(out, "IHDR", header);
+    png_chunk(out, "IDAT", deflate_encoder::zlib_compress(filtered));
+    png_chunk(out, "IEND", {});
+}
+
+
+enum image_format { PPM, PFM, PNG };
+
+inline image_format format_from_path(const std::string& path){
+    auto ends_with = [&](const char* ext){
+        std::string e(ext);
+        return path.size() >= e.size() && path.compare(path.size() - e.size(), e.size(), e) == 0;
+    };
+
+    if(ends_with(".pfm")) return PFM;
+    if(ends_with(".png")) return PNG;
+    return PPM;
+}
+
+// encodes one image to path, "-" streams it to stdout
+bool write_image(const std::string& path, const framebuffer& fb){
+    image_format format = format_from_path(path);
+
+    if(path == "-"){
+        write_ppm(std::cout, fb);
+        std::cout.flush();
+        return (bool)std::cout;
+    }
+
+    std::ofstream file(path, std::ios::binary);
+    if(!file){
+        std::cerr << "ERROR: Could not open output image '" << path << "'.\n";
+        return false;
+    }
+
+    switch(format){
+        case PPM: write_ppm(file, fb); break;
+        case PFM: write_pfm(file, fb); break;
+        case PNG: write_png(file, fb); break;
+    }
+
+    return (bool)file;
+}
+
+
+/*
+Background output stage. submit() copies the framebuffer and returns immediately; a single
+writer thread encodes and writes the queued images in submission order, so the render
+threads never block on encoding or disk. The destructor drains the queue before returning.
+*/
+class async_image_writer {
+    public:
+        async_image_writer() : stopping(false), writer([this]{ run(); }) {}
+
+        ~async_image_writer(){
+            {
+                std::lock_guard<std::mutex> guard(lock);
+                stopping = true;
+            }
+            wake.notify_one();
+            writer.join();
+        }
+
+        void submit(const framebuffer& fb, const std::string& path){
+            {
+                std::lock_guard<std::mutex> guard(lock);
+                jobs.push_back({fb, path});
+            }
+            wake.notify_one();
+        }
+
+    private:
+        struct job {
+            framebuffer image;
+            std::string path;
+        };
+
+        std::mutex lock;
+        std::condition_variable wake;
+        std::deque<job> jobs;
+        bool stopping;
+        std::thread writer;
+
+        void run(){
+            while(true){
+                job next;
+                {
+                    std::unique_lock<std::mutex> guard(lock);
+                    wake.wait(guard, [this]{ return stopping || !jobs.empty(); });
+                    if(jobs.empty()) return;
+                    next = std::move(jobs.front());
+                    jobs.pop_front();
+                }
+
+                if(write_image(next.path, next.image) && next.path != "-"){
+                    std::cerr << "Wrote " << next.path << '\n';
+                }
+            }
+        }
+};
+
+
+#endif
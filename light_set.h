@@ -0,0 +1,147 @@
+#ifndef LIGHT_SET_H
+#define LIGHT_SET_H
+
+#include <vector>
+#include <cstdint>
+
+#include "rtweekend.h"
+#include "hittable.h"
+#include "hittable_list.h"
+#include "bvh.h"
+
+
+/*
+Every light of a scene, gathered from it through hittable::collect_emitters. A light is picked with
+probability proportional to its estimated power from an alias table, which costs the same for one
+light or thousands, and then samples a direction towards itself.
+Next event estimation works per light: pick() one, sample it and count it only if it is the first
+thing the shadow ray reaches, with density probability(k) * its own pdf. A brdf sampled ray that
+runs into a light gets the same density from closest_pdf(), which finds that light in a bvh over
+the lights, so neither side depends on how many lights there are.
+As a plain hittable (random and pdf_value, for hittable_pdf) the set is one distribution over
+directions, whose density sums over every light the ray passes through.
+*/
+class light_set : public hittable {
+    public:
+        light_set() {}
+
+        light_set(const hittable_list& world, double time0, double time1) {
+            world.collect_emitters(nullptr, emitters);
+            if(emitters.empty()) return;
+
+            std::vector<shared_ptr<hittable>> shapes(emitters.size());
+            for(size_t k = 0; k < emitters.size(); k++) shapes[k] = emitters[k].shape;
+            tree = linear_bvh(shapes, time0, time1);
+
+            build_alias_table();
+        }
+
+        bool empty() const { return emitters.empty(); }
+
+        // a light index, drawn by power
+        uint32_t pick() const {
+            // one number chooses the slot and, through what is left of it, the slot's light or its alias
+            double u = random_double() * emitters.size();
+            size_t slot = (size_t)u;
+            if(slot >= emitters.size()) slot = emitters.size() - 1;
+            return u - slot < threshold[slot] ? (uint32_t)slot : alias[slot];
+        }
+
+        // density of direction v from o when light k is picked and sampled
+        double pdf_value(uint32_t k, const point3& o, const vec3& v) const {
+            return picked[k] * emitters[k].shape->pdf_value(o, v);
+        }
+
+        // pdf_value of the first light along r within [t_min, t_max], 0 when there is none
+        double closest_pdf(const ray& r, double t_min, double t_max) const {
+            hit_query query;
+            hit_record rec;
+            int closest = -1;
+            auto nearer_light = [&](uint32_t prim, double& t){
+                if(!emitters[prim].shape->intersect(r, t_min, t, query, rec)) return false;
+                t = query.t;
+                closest = (int)prim;
+                return true;
+            };
+            if(tree.accelerator == bvh_accelerator::wide) tree.wide_tree.traverse(r, t_min, t_max, nearer_light);
+            else tree.tree.traverse(r, t_min, t_max, nearer_light);
+            return closest < 0 ? 0 : pdf_value((uint32_t)closest, r.origin(), r.direction());
+        }
+
+        virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const override {
+            return tree.hit(r, t_min, t_max, rec);
+        }
+
+        virtual bool occluded(const ray& r, double t_min, double t_max) const override {
+            return tree.occluded(r, t_min, t_max);
+        }
+
+        virtual bool bounding_box(double time0, double time1, aabb& output_box) const override {
+            return tree.bounding_box(time0, time1, output_box);
+        }
+
+        virtual double pdf_value(const point3& o, const vec3& v) const override {
+            const ray r(o, v);
+            double t_max = infinity;
+            double density = 0;
+            // never lowering t_max makes the walk visit every light along the ray, not just the closest
+            auto add_light = [&](uint32_t prim, double&){
+                density += pdf_value(prim, o, v);
+                return false;
+            };
+            if(tree.accelerator == bvh_accelerator::wide) tree.wide_tree.traverse(r, 0.001, t_max, add_light);
+            else tree.tree.traverse(r, 0.001, t_max, add_light);
+            return density;
+        }
+
+        virtual vec3 random(const point3& o) const override {
+            if(emitters.empty()) return vec3(1,0,0);
+            return emitters[pick()].shape->random(o);
+        }
+
+    public:
+        std::vector<emitter> emitters;
+        linear_bvh tree;
+
+    private:
+        std::vector<double> picked;
+        std::vector<double> threshold;
+        std::vector<uint32_t> alias;
+
+        // vose's alias method: every slot keeps its own light with probability threshold and hands the
+        // rest to an alias. lights without a usable power estimate are all weighed equally
+        void build_alias_table(){
+            size_t n = emitters.size();
+            double total = 0;
+            for(const emitter& e : emitters) total += e.power;
+
+            picked.resize(n);
+            for(size_t k = 0; k < n; k++) picked[k] = total > 0 ? emitters[k].power / total : 1.0 / n;
+
+            threshold.assign(n, 1.0);
+            alias.resize(n);
+            std::vector<double> scaled(n);
+            std::vector<uint32_t> small, large;
+            for(size_t k = 0; k < n; k++){
+                alias[k] = (uint32_t)k;
+                scaled[k] = picked[k] * n;
+                (scaled[k] < 1 ? small : large).push_back((uint32_t)k);
+            }
+
+            while(!small.empty() && !large.empty()){
+                uint32_t s = small.back(), l = large.back();
+                small.pop_back();
+                threshold[s] = scaled[s];
+                alias[s] = l;
+                scaled[l] -= 1 - scaled[s];
+                if(scaled[l] < 1){
+                    large.pop_back();
+                    small.push_back(l);
+                }
+            }
+            // whatever is left is one up to rounding
+        }
+};
+
+
+#endif
@@ -1,4 +1,5 @@
 #include <iostream>
+#include <chrono>
 
 #include "rtweekend.h"
 #include "color.h"
@@ -8,58 +9,134 @@
 #include "vec3.h"
 #include "checkerboard.h"
 #include "moving_sphere.h"
+#include "sphere_set.h"
 #include "aarect.h"
 #include "box.h"
 #include "constant_medium.h"
 #include "torus.h"
 #include "triangle.h"
 #include "triangle_mesh.h"
+#include "light_set.h"
 #include "pdf.h"
+#include "renderer.h"
+#include "sampler.h"
+#include "image_writer.h"
 
  
 // implement multiple importance sampling 
 
-color ray_color(const ray& r, shared_ptr<texture>& background , const hittable& world, shared_ptr<hittable>& lights, int depth){ 
-    hit_record rec;
-    
-    if(depth <= 0)
-        return color(0,0,0);
-
-    if(!world.hit(r, 0.001, infinity, rec)){
-        // double phi = (atan2(r.direction().x(), r.direction().y()) + pi) / (2 * pi);
-        // double theta = acos(r.direction().z())/pi;
-        return background->value(0, 0 ,r.direction());
-    }
-
-    scatter_record srec;
-    color emitted = rec.mat_ptr->emitted(r, rec, rec.u, rec.v, rec.p);
-    
-    if (!rec.mat_ptr->scatter(r, rec, srec))
-        return emitted;
-    
-    if(srec.skip_pdf) {
-        return srec.attenuation * ray_color(srec.skip_pdf_ray, background, world, lights, depth - 1);
-    }
-
+// iterative path tracer. the path throughput carries the product of attenuation * brdf / pdf of every
+// bounce so far; once depth reaches rr_depth, paths are randomly terminated with probability
+// 1 - survive and survivors are reweighted by 1 / survive (russian roulette), which keeps the estimate
+// unbiased while dropping paths whose throughput has become negligible.
+// without next_event, diffuse bounces pick their direction from a 50/50 mixture of the lights and the
+// brdf and lights are only reached by continuing into them. with next_event, every diffuse vertex also
+// casts a shadow ray towards a point sampled on the lights and adds what it reaches, while the path
+// continues along the brdf alone. both estimate the light a vertex receives, so they are combined
+// with multiple importance sampling: the shadow ray's contribution and the emission a brdf sampled
+// ray runs into are each weighted by the power heuristic of the two pdfs, which favours the light
+// sample for small or distant lights and the brdf sample for large, close ones. every vertex takes one
+// sample of each strategy whatever its material: the lobes that have a pdf are all diffuse like, and
+// the specular ones (metal, dielectric, glossy's metal lobe) skip the pdf, cast no shadow ray and count
+// the emission they run into in full.
+// a light sample is counted when nothing lies in front of it up to this fraction of its distance, which
+// keeps the light's own surface from shadowing it. a brdf sampled ray asks for the lights within the
+// same fraction behind the emitter it hit, so both sides agree on which light a direction reaches
+const double shadow_gap = 0.001;
+
+color ray_color(const ray& r, shared_ptr<texture>& background , const hittable& world, shared_ptr<light_set>& lights,
+                int max_depth, int rr_depth, bool next_event){ 
+    color radiance(0,0,0);
+    color throughput(1,1,1);
+    ray current = r;
+    // the previous vertex sampled the lights directly and chose the current direction with this brdf pdf
+    bool light_sampled = false;
+    double brdf_pdf = 0;
+
+    for(int depth = 0; depth < max_depth; depth++){
+        hit_record rec;
+
+        if(!world.hit(current, 0.001, infinity, rec)){
+            // double phi = (atan2(r.direction().x(), r.direction().y()) + pi) / (2 * pi);
+            // double theta = acos(r.direction().z())/pi;
+            radiance += throughput * background->value(0, 0, current.direction());
+            break;
+        }
 
-    auto lights_pdf = make_shared<hittable_pdf>(lights, rec.p);
-    mixture_pdf mix(lights_pdf, srec.pdf_ptr);
+        scatter_record srec;
+        color emitted = rec.mat_ptr->emitted(current, rec, rec.u, rec.v, rec.p);
+        if(emitted.x() != 0 || emitted.y() != 0 || emitted.z() != 0){
+            double weight = 1;
+            // only the lights themselves could have been reached by the light sample
+            if(light_sampled)
+                weight = power_heuristic(brdf_pdf, lights->closest_pdf(current, 0.001, rec.t / (1 - shadow_gap)));
+            radiance += throughput * emitted * weight;
+        }
+        
+        if (!rec.mat_ptr->scatter(current, rec, srec))
+            break;
+        
+        light_sampled = false;
+        if(srec.skip_pdf) {
+            throughput = throughput * srec.attenuation;
+            current = srec.skip_pdf_ray;
+        }else if(next_event && lights){
+            // one light, picked by power, counted only if it is the first thing the shadow ray reaches.
+            // the light is evaluated on its own, the rest of the scene (other lights included) only has
+            // to say whether anything lies in between, which any hit answers
+            uint32_t picked = lights->pick();
+            const hittable& light_shape = *lights->emitters[picked].shape;
+            ray shadow(rec.p, light_shape.random(rec.p), current.time());
+            double light_pdf = lights->pdf_value(picked, rec.p, shadow.direction());
+            hit_record light_rec;
+            if(light_pdf > 0 && light_shape.hit(shadow, 0.001, infinity, light_rec)
+               && !world.occluded(shadow, 0.001, light_rec.t * (1 - shadow_gap))){
+                color light = light_rec.mat_ptr->emitted(shadow, light_rec, light_rec.u, light_rec.v, light_rec.p);
+                double weight = power_heuristic(light_pdf, srec.surface_pdf.value(shadow.direction()));
+                radiance += throughput * srec.attenuation * rec.mat_ptr->scattering_pdf(current, rec, shadow) * light * weight / light_pdf;
+            }
 
-    ray scattered = ray(rec.p, mix.generate(), r.time());
-    auto pdf_val = mix.value(scattered.direction());
-    
-    
+            ray scattered(rec.p, srec.surface_pdf.generate(), current.time());
+            double pdf_val = srec.surface_pdf.value(scattered.direction());
+            if(pdf_val <= 0)
+                break;
+
+            throughput = throughput * srec.attenuation * rec.mat_ptr->scattering_pdf(current, rec, scattered) / pdf_val;
+            current = scattered;
+            light_sampled = true;
+            brdf_pdf = pdf_val;
+        }else{
+            ray scattered;
+            double pdf_val = 0;
+            if(lights){
+                hittable_pdf lights_pdf(*lights, rec.p);
+                mixture_pdf mix(lights_pdf, srec.surface_pdf);
+
+                scattered = ray(rec.p, mix.generate(), current.time());
+                pdf_val = mix.value(scattered.direction());
+            }
+            
+            // no lights, or the mixture has no density there: the brdf alone
+            if(pdf_val <= 0){
+                scattered = ray(rec.p, srec.surface_pdf.generate(), current.time());
+                pdf_val = srec.surface_pdf.value(scattered.direction());
+                if(pdf_val <= 0)
+                    break;
+            }
 
-    if(pdf_val == false){
-        scattered = ray(rec.p, srec.pdf_ptr->generate(), r.time());
-        pdf_val = srec.pdf_ptr->value(scattered.direction());
+            throughput = throughput * srec.attenuation * rec.mat_ptr->scattering_pdf(current, rec, scattered) / pdf_val;
+            current = scattered;
+        }
 
+        if(depth + 1 >= rr_depth){
+            double survive = fmin(0.95, fmax(throughput.x(), fmax(throughput.y(), throughput.z())));
+            if(random_double() >= survive)
+                break;
+            throughput /= survive;
+        }
     }
-    
 
-    
-    return emitted + 
-           srec.attenuation * ray_color(scattered, background, world, lights, depth - 1) * rec.mat_ptr->scattering_pdf(r, rec, scattered)/ pdf_val;
+    return radiance;
  // attempt at two ray samping
     // // send out two rays, one that samples BRDF, one that samples the light only on the first bounce
     // // hit_record rec_brdf, rec_light;
@@ -207,7 +284,7 @@ hittable_list marble_board(){
 
 }
 
-hittable_list glossy_sphere_cornell_box(shared_ptr<hittable>& lights){
+hittable_list glossy_sphere_cornell_box(){
     hittable_list objects;
     auto red = make_shared<lambertian>(color(0.65, 0.05, 0.05));
     auto white = make_shared<lambertian>(color(0.73, 0.73, 0.73));
@@ -218,12 +295,12 @@ hittable_list glossy_sphere_cornell_box(shared_ptr<hittable>& lights){
     auto glossy_yellow = make_shared<glossy>(color(0.9, 0.9, 0.5), color(0.9, 0.9, 0.9), 0.1, 0.2);
     
     // color pastel_green = color(0.76, 0.88,  0.76);
-    lights = make_shared<xz_rect>(113, 443, 127, 432, 554, light);
+    auto ceiling_light = make_shared<flip_face>(make_shared<xz_rect>(113, 443, 127, 432, 554, light));
 
 
     objects.add(make_shared<yz_rect>(0, 555, 0, 555, 555, green));
     objects.add(make_shared<yz_rect>(0,555, 0, 555, 0, red));
-    objects.add(make_shared<flip_face>(lights));
+    objects.add(ceiling_light);
     objects.add(make_shared<xz_rect>(0, 555, 0, 555, 555, white));
     objects.add(make_shared<xz_rect>(0, 555, 0, 555, 0, white));
     objects.add(make_shared<xy_rect>(0, 555, 0, 555, 555, white));
@@ -236,7 +313,7 @@ hittable_list glossy_sphere_cornell_box(shared_ptr<hittable>& lights){
 
 }
 
-hittable_list gloss_pallette_cornell_box(shared_ptr<hittable>& lights){
+hittable_list gloss_pallette_cornell_box(){
     hittable_list objects;
     auto red = make_shared<lambertian>(color(0.65, 0.05, 0.05));
     auto white = make_shared<lambertian>(color(0.73, 0.73, 0.73));
@@ -246,12 +323,12 @@ hittable_list gloss_pallette_cornell_box(shared_ptr<hittable>& lights){
     
     
     // color pastel_green = color(0.76, 0.88,  0.76);
-    lights = make_shared<xz_rect>(113, 443, 127, 432, 554, light);
+    auto ceiling_light = make_shared<flip_face>(make_shared<xz_rect>(113, 443, 127, 432, 554, light));
 
 
     objects.add(make_shared<yz_rect>(0, 555, 0, 555, 555, green));
     objects.add(make_shared<yz_rect>(0,555, 0, 555, 0, red));
-    objects.add(make_shared<flip_face>(lights));
+    objects.add(ceiling_light);
     objects.add(make_shared<xz_rect>(0, 555, 0, 555, 555, white));
     objects.add(make_shared<xz_rect>(0, 555, 0, 555, 0, white));
     objects.add(make_shared<xy_rect>(0, 555, 0, 555, 555, white));
@@ -317,7 +394,7 @@ hittable_list plato_bust_cornell_box(){
 }
 
 
-hittable_list textured_triangle_mesh_cornell_box(shared_ptr<hittable>& lights){
+hittable_list textured_triangle_mesh_cornell_box(){
     hittable_list objects;
 
     auto red = make_shared<lambertian>(color(0.65, 0.05, 0.05));
@@ -326,11 +403,11 @@ hittable_list textured_triangle_mesh_cornell_box(shared_ptr<hittable>& lights){
     auto light = make_shared<diffuse_light>(color(15, 15, 15));
 
 
-    lights = make_shared<xz_rect>(113, 443, 127, 432, 554, light);
+    auto ceiling_light = make_shared<flip_face>(make_shared<xz_rect>(113, 443, 127, 432, 554, light));
 
     objects.add(make_shared<yz_rect>(0, 555, 0, 555, 555, green));
     objects.add(make_shared<yz_rect>(0,555, 0, 555, 0, red));
-    objects.add(make_shared<flip_face>(lights));
+    objects.add(ceiling_light);
     objects.add(make_shared<xz_rect>(0, 555, 0, 555, 555, white));
     objects.add(make_shared<xz_rect>(0, 555, 0, 555, 0, white));
     objects.add(make_shared<xy_rect>(0, 555, 0, 555, 555, white));
@@ -416,7 +493,7 @@ hittable_list simple_light(){
     return objects;
 }
 
-hittable_list cornell_box(shared_ptr<hittable>& lights){
+hittable_list cornell_box(){
     hittable_list objects;
 
     auto red = make_shared<lambertian>(color(0.65, 0.05, 0.05));
@@ -424,10 +501,10 @@ hittable_list cornell_box(shared_ptr<hittable>& lights){
     auto green = make_shared<lambertian>(color(0.12, 0.45, 0.15));
     auto light = make_shared<diffuse_light>(color(15, 15, 15));
 
-    lights = make_shared<xz_rect>(213, 343, 227, 332, 554, light);
+    auto ceiling_light = make_shared<flip_face>(make_shared<xz_rect>(213, 343, 227, 332, 554, light));
     objects.add(make_shared<yz_rect>(0, 555, 0, 555, 555, green));
     objects.add(make_shared<yz_rect>(0,555, 0, 555, 0, red));
-    objects.add(make_shared<flip_face>(lights));
+    objects.add(ceiling_light);
     objects.add(make_shared<xz_rect>(0, 555, 0, 555, 555, white));
     objects.add(make_shared<xz_rect>(0, 555, 0, 555, 0, white));
     objects.add(make_shared<xy_rect>(0, 555, 0, 555, 555, white));
@@ -548,7 +625,7 @@ hittable_list smoke_box_and_torus(){
 
 }
 
-hittable_list utah_teapot(shared_ptr<hittable>& lights){
+hittable_list utah_teapot(){
     hittable_list objects;
     
 
@@ -557,10 +634,10 @@ hittable_list utah_teapot(shared_ptr<hittable>& lights){
     auto green = make_shared<lambertian>(color(0.12, 0.45, 0.15));
     auto light = make_shared<diffuse_light>(color(15, 15, 15));
 
-    lights = make_shared<xz_rect>(113, 443, 127, 432, 554, light);
+    auto ceiling_light = make_shared<flip_face>(make_shared<xz_rect>(113, 443, 127, 432, 554, light));
     objects.add(make_shared<yz_rect>(0, 555, 0, 555, 555, green));
     objects.add(make_shared<yz_rect>(0,555, 0, 555, 0, red));
-    objects.add(make_shared<flip_face>(lights));
+    objects.add(ceiling_light);
     objects.add(make_shared<xz_rect>(0, 555, 0, 555, 555, white));
     objects.add(make_shared<xz_rect>(0, 555, 0, 555, 0, white));
     objects.add(make_shared<xy_rect>(0, 555, 0, 555, 555, white));
@@ -606,7 +683,7 @@ hittable_list utah_teapot(shared_ptr<hittable>& lights){
 
 }
 
-hittable_list checkerboard_scene(shared_ptr<hittable>& lights){
+hittable_list checkerboard_scene(){
     hittable_list objects;
 
 
@@ -649,13 +726,13 @@ hittable_list checkerboard_scene(shared_ptr<hittable>& lights){
 
 
     
-    lights = make_shared<xz_rect>(113, 443, 127, 432, 554, light);
+    auto ceiling_light = make_shared<flip_face>(make_shared<xz_rect>(113, 443, 127, 432, 554, light));
     
 
 
     objects.add(glass_teapot);
     objects.add(glossy_teapot);
-    objects.add(make_shared<flip_face>(lights));
+    objects.add(ceiling_light);
     objects.add(cboard_floor);
     objects.add(cboard_wall);
 
@@ -667,9 +744,11 @@ hittable_list checkerboard_scene(shared_ptr<hittable>& lights){
 
 hittable_list random_scene(){
     hittable_list world;
+    // all of the scene's spheres go into one sphere_set, which intersects them four at a time
+    auto spheres = make_shared<sphere_set>();
     
     auto checker = make_shared<checker_texture>(color(0.2, 0.3, 0.1), color(0.9, 0.9, 0.9));
-    world.add(make_shared<sphere>(point3(0,-1000,0), 1000, make_shared<lambertian>(checker)));
+    spheres->add(point3(0,-1000,0), 1000, make_shared<lambertian>(checker));
 
     for (int a = -11; a < 11; a++) {
         for (int b = -11; b < 11; b++) {
@@ -684,31 +763,34 @@ hittable_list random_scene(){
                     auto albedo = random() * random();
                     sphere_material = make_shared<lambertian>(albedo);
                     auto center2 = center + vec3(0, random_double(0,.5), 0);
-                    world.add(make_shared<moving_sphere>(
-                        center, center2, 0.0, 1.0, 0.2, sphere_material));
+                    spheres->add(center, center2, 0.0, 1.0, 0.2, sphere_material);
                 } else if (choose_mat < 0.95) {
                     // metal
                     auto albedo = random(0.5, 1);
                     auto fuzz = random_double(0, 0.5);
                     sphere_material = make_shared<metal>(albedo, fuzz);
-                    world.add(make_shared<sphere>(center, 0.2, sphere_material));
+                    spheres->add(center, 0.2, sphere_material);
                 } else {
                     // glass
                     sphere_material = make_shared<dielectric>(1.5);
-                    world.add(make_shared<sphere>(center, 0.2, sphere_material));
+                    spheres->add(center, 0.2, sphere_material);
                 }
             }
         }
     }
 
     auto material1 = make_shared<dielectric>(1.5);
-    world.add(make_shared<sphere>(point3(0, 1, 0), 1.0, material1));
+    spheres->add(point3(0, 1, 0), 1.0, material1);
 
     auto material2 = make_shared<lambertian>(color(0.4, 0.2, 0.1));
-    world.add(make_shared<sphere>(point3(-4, 1, 0), 1.0, material2));
+    spheres->add(point3(-4, 1, 0), 1.0, material2);
 
     auto material3 = make_shared<metal>(color(0.7, 0.6, 0.5), 0.0);
-    world.add(make_shared<sphere>(point3(4, 1, 0), 1.0, material3));
+    spheres->add(point3(4, 1, 0), 1.0, material3);
+
+    // the camera's shutter is open from 0 to 1
+    spheres->build(0.0, 1.0);
+    world.add(spheres);
 
     return world;
 
@@ -724,13 +806,23 @@ int main(){
     int image_width = 600; // 3840
     int image_height = static_cast<int>(image_width / aspect_ratio);
     int samples_per_pixel = 80;
-    int sqrt_ssp = (int)sqrt(samples_per_pixel);
+    // where the sample values of every path dimension come from, see sampler.h
+    sampler_type sampling = sampler_type::sobol;
     int max_depth = 5;
+    // paths become candidates for russian roulette termination after this many bounces
+    int rr_depth = 3;
+    // direct light through shadow rays at every diffuse vertex, rather than only by hitting the lights
+    bool next_event = true;
+    uint64_t seed = 0;
+    // .ppm (binary P6), .pfm (linear float) or .png. "-" streams a P6 ppm to stdout
+    std::string output_file = "-";
+
+    seed_random(seed);
 
     //world
     hittable_list world;
-    //lights
-    shared_ptr<hittable> lights;
+    //lights, gathered from the world once it is built
+    shared_ptr<light_set> lights;
 
     point3 lookfrom;
     point3 lookat;
@@ -786,12 +878,11 @@ int main(){
             break;
 
         case 7:
-            world = cornell_box(lights);
+            world = cornell_box();
             aspect_ratio = 1.0;
             image_width = 600;
             image_height = static_cast<int>(image_width / aspect_ratio);
             samples_per_pixel = 10;
-            sqrt_ssp = (int)sqrt(samples_per_pixel);
             background = make_shared<solid_color>(color(0,0,0));
             lookfrom = point3(278, 278, -800);
             lookat = point3(278, 278, 0);
@@ -805,7 +896,6 @@ int main(){
             image_width = 1920;
             image_height = static_cast<int>(image_width / aspect_ratio);
             samples_per_pixel = 500;
-            sqrt_ssp = (int)sqrt(samples_per_pixel);
             lookfrom = point3(278,278,-800);
             lookat = point3(278,278,0);
             vfov = 40.0;
@@ -817,7 +907,6 @@ int main(){
             image_width = 600;
             image_height = static_cast<int>(image_width / aspect_ratio);
             samples_per_pixel = 50;
-            sqrt_ssp = (int)sqrt(samples_per_pixel);
             lookfrom = point3(278,278,-800);
             lookat = point3(278,278,0);
             vfov = 40.0;
@@ -829,7 +918,6 @@ int main(){
             image_width = 600;
             image_height = static_cast<int>(image_width / aspect_ratio);
             samples_per_pixel = 10;
-            sqrt_ssp = (int)sqrt(samples_per_pixel);
             lookfrom = point3(278,278,-800);
             lookat = point3(278,278,0);
             vfov = 40.0;
@@ -841,19 +929,17 @@ int main(){
             image_width = 600;
             image_height = static_cast<int>(image_width / aspect_ratio);
             samples_per_pixel = 100;
-            sqrt_ssp = (int)sqrt(samples_per_pixel);
             lookfrom = point3(278,278,-800);
             lookat = point3(278,278,0);
             vfov = 40.0;
             break;
         
         case 12:
-            world = textured_triangle_mesh_cornell_box(lights);
+            world = textured_triangle_mesh_cornell_box();
             aspect_ratio = 1.0;
             image_width = 600;
             image_height = static_cast<int>(image_width / aspect_ratio);
             samples_per_pixel = 30;
-            sqrt_ssp = (int)sqrt(samples_per_pixel);
             lookfrom = point3(278,278,-800);
             lookat = point3(278,278,0);
             vfov = 40.0;
@@ -865,19 +951,17 @@ int main(){
             image_width = 600;
             image_height = static_cast<int>(image_width / aspect_ratio);
             samples_per_pixel = 1000;
-            sqrt_ssp = (int)sqrt(samples_per_pixel);
             lookfrom = point3(278,278,-800);
             lookat = point3(278,278,0);
             vfov = 40.0;
             break;
         
         case 14:
-            world = glossy_sphere_cornell_box(lights);
+            world = glossy_sphere_cornell_box();
             aspect_ratio = 1.0;
             image_width = 600;
             image_height = static_cast<int>(image_width / aspect_ratio);
             samples_per_pixel = 20;
-            sqrt_ssp = (int)sqrt(samples_per_pixel);
             background = make_shared<solid_color>(color(0,0,0));
             lookfrom = point3(278, 278, -800);
             lookat = point3(278, 278, 0);
@@ -886,12 +970,11 @@ int main(){
             break;
 
         case 15:
-            world = gloss_pallette_cornell_box(lights);
+            world = gloss_pallette_cornell_box();
             aspect_ratio = 1.0;
             image_width = 600;
             image_height = static_cast<int>(image_width / aspect_ratio);
             samples_per_pixel = 100;
-            sqrt_ssp = (int)sqrt(samples_per_pixel);
             background = make_shared<solid_color>(color(0,0,0));
             lookfrom = point3(278, 278, -800);
             lookat = point3(278, 278, 0);
@@ -900,12 +983,11 @@ int main(){
             break;
 
         case 16:
-            world = utah_teapot(lights);
+            world = utah_teapot();
             aspect_ratio = 1.0;
             image_width = 600;
             image_height = static_cast<int>(image_width / aspect_ratio);
             samples_per_pixel = 100;
-            sqrt_ssp = (int)sqrt(samples_per_pixel);
             background = make_shared<solid_color>(color(0,0,0));
             lookfrom = point3(278, 278, -800);
             lookat = point3(278, 278, 0);
@@ -915,13 +997,12 @@ int main(){
         
         default:
         case 17:
-            world = checkerboard_scene(lights);
+            world = checkerboard_scene();
             image_width = 1920;
             aspect_ratio = 1.0;
 
             image_height = static_cast<int>(image_width / aspect_ratio);
             samples_per_pixel = 2000;
-            sqrt_ssp = (int)sqrt(samples_per_pixel);
 
             /*Cubemap faces*/
             shared_ptr<texture> posx = make_shared<image_texture>("./textures/LancellottiChapel/posx.jpg");    
@@ -955,46 +1036,98 @@ int main(){
 
     camera cam(lookfrom, lookat, vup, vfov, aspect_ratio, aperture, dist_to_focus, 0.0, 1.0);
 
-    std::cout<<"P3\n"<<image_width<<' '<<image_height<<'\n'<<255<<'\n';
-    for(int j = image_height - 1; j>=0; j--){
-        std::cerr << "\rScanlines remaining: "<< j << ' '<<std::flush;
-        for(int i = 0; i < image_width; i++){
-            
-            color pixel_color(0,0,0);
-            // for (int s = 0; s < samples_per_pixel; ++s) {
-            //     auto u = (i + random_double()) / (image_width-1);
-            //     auto v = (j + random_double()) / (image_height-1);
-            //     ray r = cam.get_ray(u, v);
-            //     pixel_color += ray_color(r, world, max_depth);
-            // }
-            // snippet distributing samples_per_pixel rays EVENLY over a pixel
-
-            auto u = double(i) / (image_width - 1);
-            auto v = double(j) / (image_height - 1);
-            
-            for(int shift_u = 0; shift_u < sqrt_ssp; shift_u ++){
-                u += 1.0/(sqrt_ssp * (image_width - 1));
-                for(int shift_v = 0; shift_v < sqrt_ssp; shift_v ++){
-                    v += 1.0/(sqrt_ssp * (image_height - 1));
-                
-                    ray r = cam.get_ray(u,v);
-                    color sample_color = ray_color(r, background, world, lights, max_depth);
-                    
-                    // deal with pesky NaNs
-                    if(sample_color.r() != sample_color.r() || sample_color.g() != sample_color.g() || sample_color.b() != sample_color.b()){
-                        continue;
-                    }else{
-                        pixel_color += sample_color; 
-                    }
-                }
-                v = double(j) / (image_height - 1);
-            }
-            write_color(std::cout, pixel_color, samples_per_pixel); 
+    // adaptive sampling spends the same samples_per_pixel budget unevenly: pixels stop once their noise
+    // is under target_error, and what they save goes to the ones that are still noisy, up to max_samples.
+    // it is used whenever the budget leaves room to stop early
+    adaptive_sampling adaptive_settings;
+    adaptive_settings.min_samples = 32;
+    adaptive_settings.max_samples = 4 * samples_per_pixel;
+    adaptive_settings.target_error = 0.02;
+    bool adaptive = samples_per_pixel >= 4 * adaptive_settings.min_samples;
+    if(adaptive && !adaptive_sampling::resumes_fresh(thread_sampler(sampling), 0, (uint32_t)samples_per_pixel)){
+        std::cerr << "The sampler repeats samples when a pixel is resumed, adaptive sampling turned off.\n";
+        adaptive = false;
+    }
+    std::vector<adaptive_sampling::pixel_estimate> estimates;
+    std::vector<int> sample_limits;
+    if(adaptive) estimates.resize((size_t)image_width * image_height);
+
+    // two level acceleration: a bvh over the scene's objects on top of the per mesh bvhs
+    top_level_bvh world_bvh(world, cam.time0, cam.time1);
+
+    // every emitter of the scene, sampled by power. scenes without any render without light sampling
+    lights = make_shared<light_set>(world, cam.time0, cam.time1);
+    if(lights->empty()) lights = nullptr;
+
+    framebuffer image(image_width, image_height);
+
+    // the writer works next to the render. every preview_seconds the tiles finished so far go to it as
+    // a preview of the output (files only, stdout takes a single image), and the final image follows
+    // once rendering is done. its destructor waits for the last write
+    double preview_seconds = 10;
+    async_image_writer writer;
+    framebuffer preview(image_width, image_height);
+    std::mutex preview_lock;
+    auto last_preview = std::chrono::steady_clock::now();
+
+    // runs on the thread that rendered t, so its pixels are read by the thread that wrote them
+    auto preview_tile = [&](const tile& t){
+        if(output_file == "-") return;
+        std::lock_guard<std::mutex> guard(preview_lock);
+        for(int j = t.y0; j < t.y1; j++){
+            for(int i = t.x0; i < t.x1; i++) preview.at(i, j) = image.at(i, j);
+        }
 
-            
+        auto now = std::chrono::steady_clock::now();
+        if(std::chrono::duration<double>(now - last_preview).count() < preview_seconds) return;
+        last_preview = now;
+        writer.submit(preview, output_file);
+    };
+
+    auto shade_pixel = [&](int i, int j){
+        sampler& pixel_sampler = thread_sampler(sampling);
+        scoped_sampler bound(pixel_sampler);
+        pixel_sampler.start_pixel((uint64_t)j * image_width + i);
+
+        // the first two dimensions of a sample place it in the pixel
+        auto sample = [&](uint32_t index){
+            pixel_sampler.start_sample(index);
+            auto u = (i + random_double()) / (image_width - 1);
+            auto v = (j + random_double()) / (image_height - 1);
+            return ray_color(cam.get_ray(u, v), background, world_bvh, lights, max_depth, rr_depth, next_event);
+        };
+
+        // the first pass stops at the per pixel budget, the second one at the pixel's share of the spare
+        if(adaptive){
+            size_t k = (size_t)j * image_width + i;
+            adaptive_sampling::pixel_estimate& estimate = estimates[k];
+            adaptive_settings.refine(sample, estimate, sample_limits.empty() ? samples_per_pixel : sample_limits[k]);
+            return estimate.mean();
+        }
+
+        color pixel_color(0,0,0);
+        for(int s = 0; s < samples_per_pixel; s++){
+            color sample_color = sample((uint32_t)s);
 
+            // deal with pesky NaNs, they count as black samples
+            if(sample_color.r() != sample_color.r() || sample_color.g() != sample_color.g() || sample_color.b() != sample_color.b())
+                continue;
+            pixel_color += sample_color;
         }
-    }
 
+        return pixel_color / samples_per_pixel;
+    };
+
+    render_tiles(image, shade_pixel, preview_tile);
+
+    if(adaptive){
+        sample_limits = adaptive_settings.share_spare(estimates, (long long)samples_per_pixel * image_width * image_height);
+        render_tiles(image, shade_pixel, preview_tile);
+
+        long long taken = 0;
+        for(const adaptive_sampling::pixel_estimate& estimate : estimates) taken += estimate.n;
+        std::cerr << "Average samples per pixel: " << double(taken) / (image_width * image_height) << '\n';
+    }
 
+    writer.submit(image, output_file);
 }
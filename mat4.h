@@ -0,0 +1,122 @@
+#ifndef MAT4_H
+#define MAT4_H
+
+#include <cmath>
+#include "rtweekend.h"
+#include "vec3.h"
+
+
+// 4x4 affine matrix, row major, acting on column vectors. the bottom row is always (0, 0, 0, 1)
+// so only the upper 3x4 block is ever used.
+class mat4 {
+    public:
+        double m[4][4];
+
+        mat4() : m{{1,0,0,0}, {0,1,0,0}, {0,0,1,0}, {0,0,0,1}} {}
+
+        static mat4 translation(const vec3& offset){
+            mat4 r;
+            r.m[0][3] = offset.x();
+            r.m[1][3] = offset.y();
+            r.m[2][3] = offset.z();
+            return r;
+        }
+
+        static mat4 scaling(const vec3& s){
+            mat4 r;
+            r.m[0][0] = s.x();
+            r.m[1][1] = s.y();
+            r.m[2][2] = s.z();
+            return r;
+        }
+
+        // rotations by an angle in degrees, counter clockwise looking down the axis
+        static mat4 rotation_x(double angle){
+            double c = cos(degrees_to_radians(angle)), s = sin(degrees_to_radians(angle));
+            mat4 r;
+            r.m[1][1] = c; r.m[1][2] = -s;
+            r.m[2][1] = s; r.m[2][2] = c;
+            return r;
+        }
+
+        static mat4 rotation_y(double angle){
+            double c = cos(degrees_to_radians(angle)), s = sin(degrees_to_radians(angle));
+            mat4 r;
+            r.m[0][0] = c;  r.m[0][2] = s;
+            r.m[2][0] = -s; r.m[2][2] = c;
+            return r;
+        }
+
+        static mat4 rotation_z(double angle){
+            double c = cos(degrees_to_radians(angle)), s = sin(degrees_to_radians(angle));
+            mat4 r;
+            r.m[0][0] = c; r.m[0][1] = -s;
+            r.m[1][0] = s; r.m[1][1] = c;
+            return r;
+        }
+
+        mat4 operator*(const mat4& b) const {
+            mat4 r;
+            for(int i = 0; i < 4; i++){
+                for(int j = 0; j < 4; j++){
+                    r.m[i][j] = m[i][0] * b.m[0][j] + m[i][1] * b.m[1][j] + m[i][2] * b.m[2][j] + m[i][3] * b.m[3][j];
+                }
+            }
+            return r;
+        }
+
+        point3 transform_point(const point3& p) const {
+            return point3(m[0][0] * p.x() + m[0][1] * p.y() + m[0][2] * p.z() + m[0][3],
+                          m[1][0] * p.x() + m[1][1] * p.y() + m[1][2] * p.z() + m[1][3],
+                          m[2][0] * p.x() + m[2][1] * p.y() + m[2][2] * p.z() + m[2][3]);
+        }
+
+        vec3 transform_vector(const vec3& v) const {
+            return vec3(m[0][0] * v.x() + m[0][1] * v.y() + m[0][2] * v.z(),
+                        m[1][0] * v.x() + m[1][1] * v.y() + m[1][2] * v.z(),
+                        m[2][0] * v.x() + m[2][1] * v.y() + m[2][2] * v.z());
+        }
+
+        // upper 3x3 transposed, translation dropped. the transposed inverse is what carries normals
+        mat4 transposed_linear() const {
+            mat4 r;
+            for(int i = 0; i < 3; i++){
+                for(int j = 0; j < 3; j++){
+                    r.m[i][j] = m[j][i];
+                }
+            }
+            return r;
+        }
+
+        // determinant of the 3x3 block, the factor the map scales volumes by
+        double linear_determinant() const {
+            return m[0][0] * (m[1][1] * m[2][2] - m[1][2] * m[2][1])
+                 - m[0][1] * (m[1][0] * m[2][2] - m[1][2] * m[2][0])
+                 + m[0][2] * (m[1][0] * m[2][1] - m[1][1] * m[2][0]);
+        }
+
+        // inverse of an affine matrix: invert the 3x3 block by cofactors, then undo the translation
+        mat4 inverse() const {
+            double inv_det = 1.0 / linear_determinant();
+
+            mat4 r;
+            r.m[0][0] =  (m[1][1] * m[2][2] - m[1][2] * m[2][1]) * inv_det;
+            r.m[0][1] = -(m[0][1] * m[2][2] - m[0][2] * m[2][1]) * inv_det;
+            r.m[0][2] =  (m[0][1] * m[1][2] - m[0][2] * m[1][1]) * inv_det;
+            r.m[1][0] = -(m[1][0] * m[2][2] - m[1][2] * m[2][0]) * inv_det;
+            r.m[1][1] =  (m[0][0] * m[2][2] - m[0][2] * m[2][0]) * inv_det;
+            r.m[1][2] = -(m[0][0] * m[1][2] - m[0][2] * m[1][0]) * inv_det;
+            r.m[2][0] =  (m[1][0] * m[2][1] - m[1][1] * m[2][0]) * inv_det;
+            r.m[2][1] = -(m[0][0] * m[2][1] - m[0][1] * m[2][0]) * inv_det;
+            r.m[2][2] =  (m[0][0] * m[1][1] - m[0][1] * m[1][0]) * inv_det;
+
+            vec3 t = r.transform_vector(vec3(m[0][3], m[1][3], m[2][3]));
+            r.m[0][3] = -t.x();
+            r.m[1][3] = -t.y();
+            r.m[2][3] = -t.z();
+            return r;
+        }
+};
+
+
+#endif
@@ -18,7 +18,7 @@ struct hit_record;
 struct scatter_record {
 
         color attenuation;
-        shared_ptr<pdf> pdf_ptr;
+        scatter_pdf surface_pdf;
         bool skip_pdf; 
         ray skip_pdf_ray;
 
@@ -34,9 +34,26 @@ class material {
         virtual double scattering_pdf(const ray& r_in, const hit_record& rec, const ray& scattered) const {
             return 0;
         }
+        // typical radiance given off, only used to weigh lights against each other. zero for anything
+        // that is not a light
+        virtual color average_emission() const {
+            return color(0,0,0);
+        }
 
 };
 
+// rough power of a light of material m and surface area 'area', from the luminance of its emission
+inline double emitted_power(const material& m, double area){
+    color e = m.average_emission();
+    return area * (0.2126 * e.x() + 0.7152 * e.y() + 0.0722 * e.z());
+}
+
+// adds self to out when its material makes it a light
+inline void collect_if_emitting(const shared_ptr<hittable>& self, const material& m, double area, std::vector<emitter>& out){
+    double power = emitted_power(m, area);
+    if(power > 0) out.push_back({self, power});
+}
+
 // note about diamond problem and virtual inheritance https://www.sandordargo.com/blog/2020/12/23/virtual-inheritance
 class lambertian : virtual public material{
     public:
@@ -46,7 +63,7 @@ class lambertian : virtual public material{
         virtual bool scatter(const ray& r_in, const hit_record& rec, scatter_record& srec) const override{
             // vec3 scatter_direction = rec.normal + random_unit_vector(); 
             srec.attenuation = albedo -> value(rec.u,rec.v, rec.p);
-            srec.pdf_ptr = make_shared<cosine_pdf>(rec.normal);
+            srec.surface_pdf.set_cosine(rec.normal);
             srec.skip_pdf = false;
 
             return true;
@@ -70,7 +87,7 @@ class metal : virtual public material {
 
         virtual bool scatter(const ray& r_in, const hit_record& rec, scatter_record& srec) const override{
             srec.attenuation = albedo;
-            srec.pdf_ptr = nullptr;
+            srec.surface_pdf.set_none();
             srec.skip_pdf = true;
             vec3 reflected = reflect(unit_vector(r_in.direction()), rec.normal);
             srec.skip_pdf_ray = ray(rec.p, reflected + fuzz*random_in_unit_sphere(), r_in.time());
@@ -144,7 +161,7 @@ class dielectric : public material {
             
             srec.attenuation = att;
             double refraction_ratio = rec.front_face ? (1.0/ir) : ir;
-            srec.pdf_ptr = nullptr;
+            srec.surface_pdf.set_none();
             srec.skip_pdf = true;
             vec3 unit_direction = unit_vector(r_in.direction());
             double cos_theta = fmin(dot(-unit_direction, rec.normal), 1.0);
@@ -250,6 +267,11 @@ class diffuse_light : public material {
                 return color(0,0,0);
         }
 
+        // textured emission is judged by the middle of its uv range
+        virtual color average_emission() const override {
+            return emit->value(0.5, 0.5, point3(0,0,0));
+        }
+
     public:
         shared_ptr<texture> emit;
 
@@ -262,11 +284,16 @@ class isotropic : public material {
 
         virtual bool scatter(const ray& r_in, const hit_record& rec, scatter_record& srec) const override {
             srec.attenuation = albedo->value(rec.u, rec.v, rec.p);
-            srec.pdf_ptr = make_shared<sphere_pdf>();
+            srec.surface_pdf.set_uniform_sphere();
             srec.skip_pdf = false;
             return true;
         }
 
+        // the phase function, uniform over the sphere of directions
+        double scattering_pdf(const ray&, const hit_record&, const ray&) const override {
+            return 1 / (4 * pi);
+        }
+
     public:
         shared_ptr<texture> albedo;
 
@@ -0,0 +1,207 @@
+#ifndef MESH_SNAPSHOT_H
+#define MESH_SNAPSHOT_H
+
+#include <vector>
+#include <string>
+#include <fstream>
+#include <cstring>
+#include <cstdio>
+#include <cstdint>
+#include <utility>
+#include <sys/stat.h>
+
+#include "obj_loader.h"
+#include "bvh.h"
+#include "triangle.h"
+
+
+/*
+Binary snapshot of a loaded mesh, written next to the .obj as <file>.snapshot after the first load.
+It holds the vertex buffer, the index buffer, the face packets and the finished bvh, so a later run
+maps it and copies the arrays straight out instead of parsing text and rebuilding the tree.
+
+layout: mesh_snapshot_header, then vertices, indices, face packets and bvh nodes, each array
+starting on a 16 byte boundary. a snapshot is only used when its version, winding and the size and
+modification time (in nanoseconds where the platform keeps them) of its source file all match, and
+when every index it holds stays within the arrays it points into, so a stale or damaged file can not
+send traversal out of bounds. anything else parses the .obj and rebuilds it.
+*/
+const uint32_t mesh_snapshot_version = 6;
+
+struct mesh_snapshot_header {
+    char magic[8];
+    uint32_t version;
+    int32_t winding;
+    uint64_t source_size;
+    int64_t source_mtime;
+    uint64_t vertex_count;
+    uint64_t index_count;
+    uint64_t packet_count;
+    uint64_t node_count;
+};
+
+
+namespace snapshot_detail {
+
+    inline size_t align16(size_t offset){ return (offset + 15) & ~(size_t)15; }
+
+    inline bool source_stamp(const char* filename, uint64_t& size, int64_t& mtime){
+        struct stat st;
+        if(stat(filename, &st) != 0) return false;
+        size = (uint64_t)st.st_size;
+#if defined(__APPLE__)
+        mtime = (int64_t)st.st_mtimespec.tv_sec * 1000000000 + st.st_mtimespec.tv_nsec;
+#elif defined(__unix__)
+        mtime = (int64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+#else
+        mtime = (int64_t)st.st_mtime;
+#endif
+        return true;
+    }
+
+    inline void write_array(std::ofstream& out, size_t& offset, const void* data, size_t bytes){
+        static const char zeros[16] = {};
+        size_t aligned = align16(offset);
+        out.write(zeros, aligned - offset);
+        out.write((const char*)data, bytes);
+        offset = aligned + bytes;
+    }
+
+    template<class T>
+    bool read_array(const mapped_file& file, size_t& offset, uint64_t count, std::vector<T>& out){
+        offset = align16(offset);
+        if(offset > file.size || count > (file.size - offset) / sizeof(T)) return false;
+        size_t bytes = (size_t)count * sizeof(T);
+        out.resize(count);
+        if(bytes) std::memcpy(out.data(), file.begin + offset, bytes);
+        offset += bytes;
+        return true;
+    }
+
+    // every index in range: vertices of the faces, faces of the packets, and nodes and packets of the
+    // tree, whose interior children must come after their parent (as collapse stores them) and which
+    // must fit the traversal stack. unused node slots are the empty box wide_bvh_node() leaves
+    inline bool consistent(const std::vector<mesh_vertex>& vertices, const std::vector<uint32_t>& indices,
+                           const std::vector<face_packet>& packets, const wide_bvh& tree){
+        if(indices.size() % 4 != 0) return false;
+        for(uint32_t index : indices){
+            if(index >= vertices.size()) return false;
+        }
+
+        const uint32_t known_flags = face_packet::has_uv | face_packet::has_normal | face_packet::is_quad;
+        size_t face_count = indices.size() / 4;
+        for(const face_packet& packet : packets){
+            for(int lane = 0; lane < 4; lane++){
+                if(packet.face[lane] >= face_count && !(packet.face[lane] == 0 && packet.flags[lane] == 0)) return false;
+                if(packet.flags[lane] & ~known_flags) return false;
+            }
+        }
+
+        if(tree.nodes.empty()) return packets.empty();
+        std::vector<std::pair<uint32_t, int>> pending = {{0, 1}};
+        while(!pending.empty()){
+            uint32_t index = pending.back().first;
+            int depth = pending.back().second;
+            pending.pop_back();
+            if(depth > 64) return false;
+
+            const wide_bvh_node& node = tree.nodes[index];
+            for(int i = 0; i < 4; i++){
+                if(node.count[i] > 0){
+                    if(node.count[i] != 1 || node.child[i] >= packets.size()) return false;
+                }else if(node.child[i] == 0){
+                    for(int a = 0; a < 3; a++){
+                        if(node.bounds[a][i] != INFINITY || node.bounds[a + 3][i] != -INFINITY) return false;
+                    }
+                }else{
+                    if(node.child[i] <= index || node.child[i] >= tree.nodes.size()) return false;
+                    pending.push_back({node.child[i], depth + 1});
+                }
+            }
+        }
+        return true;
+    }
+}
+
+
+inline std::string mesh_snapshot_path(const char* obj_filename){
+    return std::string(obj_filename) + ".snapshot";
+}
+
+// false when there is no usable snapshot for this file and winding
+inline bool read_mesh_snapshot(const char* obj_filename, int winding, std::vector<mesh_vertex>& vertices,
+                               std::vector<uint32_t>& indices, std::vector<face_packet>& packets, wide_bvh& tree){
+    using namespace snapshot_detail;
+
+    uint64_t source_size;
+    int64_t source_mtime;
+    if(!source_stamp(obj_filename, source_size, source_mtime)) return false;
+
+    mapped_file file(mesh_snapshot_path(obj_filename).c_str());
+    if(!file.is_open() || file.size < sizeof(mesh_snapshot_header)) return false;
+
+    mesh_snapshot_header header;
+    std::memcpy(&header, file.begin, sizeof(header));
+    if(std::memcmp(header.magic, "RTMESH\0\0", 8) != 0 || header.version != mesh_snapshot_version
+        || header.winding != winding || header.source_size != source_size || header.source_mtime != source_mtime){
+        return false;
+    }
+
+    size_t offset = sizeof(header);
+    if(read_array(file, offset, header.vertex_count, vertices)
+        && read_array(file, offset, header.index_count, indices)
+        && read_array(file, offset, header.packet_count, packets)
+        && read_array(file, offset, header.node_count, tree.nodes)
+        && consistent(vertices, indices, packets, tree)){
+        return true;
+    }
+
+    // nothing of a rejected snapshot is kept, the caller builds from scratch
+    vertices.clear();
+    indices.clear();
+    packets.clear();
+    tree.nodes.clear();
+    return false;
+}
+
+// best effort: any failure (e.g. a read only resource directory) removes what was written and
+// returns false, which only means the next run builds again
+inline bool write_mesh_snapshot(const char* obj_filename, int winding, const std::vector<mesh_vertex>& vertices,
+                                const std::vector<uint32_t>& indices, const std::vector<face_packet>& packets, const wide_bvh& tree){
+    using namespace snapshot_detail;
+
+    mesh_snapshot_header header = {};
+    std::memcpy(header.magic, "RTMESH\0\0", 8);
+    header.version = mesh_snapshot_version;
+    header.winding = winding;
+    if(!source_stamp(obj_filename, header.source_size, header.source_mtime)) return false;
+    header.vertex_count = vertices.size();
+    header.index_count = indices.size();
+    header.packet_count = packets.size();
+    header.node_count = tree.nodes.size();
+
+    // written under a temporary name and renamed, so a concurrent run never maps half a file
+    std::string path = mesh_snapshot_path(obj_filename);
+    std::string temp_path = path + ".tmp";
+    bool written;
+    {
+        std::ofstream out(temp_path, std::ios::binary | std::ios::trunc);
+        if(!out) return false;
+
+        size_t offset = 0;
+        write_array(out, offset, &header, sizeof(header));
+        write_array(out, offset, vertices.data(), vertices.size() * sizeof(mesh_vertex));
+        write_array(out, offset, indices.data(), indices.size() * sizeof(uint32_t));
+        write_array(out, offset, packets.data(), packets.size() * sizeof(face_packet));
+        write_array(out, offset, tree.nodes.data(), tree.nodes.size() * sizeof(wide_bvh_node));
+        out.close();
+        written = !out.fail();
+    }
+
+    if(written && std::rename(temp_path.c_str(), path.c_str()) == 0) return true;
+    std::remove(temp_path.c_str());
+    return false;
+}
+
+
+#endif
@@ -10,7 +10,11 @@ class moving_sphere : public hittable {
     moving_sphere(point3 cen0, point3 cen1, double _time0, double _time1, double r, shared_ptr<material> m)
     : center0(cen0), center1(cen1), time0(_time0), time1(_time1), radius(r), mat_ptr(m) {};
 
-    virtual bool hit( const ray& r, double t_min, double t_max, hit_record& rec) const override;
+    virtual bool hit( const ray& r, double t_min, double t_max, hit_record& rec) const override {
+        return deferred_hit(r, t_min, t_max, rec);
+    }
+    virtual bool intersect(const ray& r, double t_min, double t_max, hit_query& query, hit_record& rec) const override;
+    virtual void evaluate_surface(const ray& r, const hit_query& query, hit_record& rec) const override;
     virtual bool bounding_box(double time0, double time1, aabb& output_box) const override;
 
 
@@ -27,7 +31,7 @@ point3 moving_sphere::center(double time) const{
     return center0 + (center1 - center0) / (time1 - time0) * (time - time0);
 }
 
-bool moving_sphere::hit(const ray& r, double t_min, double t_max, hit_record& rec) const {
+bool moving_sphere::intersect(const ray& r, double t_min, double t_max, hit_query& query, hit_record&) const {
     vec3 oc =  r.origin() - center(r.time());
     auto a = r.direction().length_squared();
     auto half_b = dot(oc, r.direction());
@@ -44,14 +48,19 @@ bool moving_sphere::hit(const ray& r, double t_min, double t_max, hit_record& re
             return false;
     }
     
-    rec.t = root;
+    query.t = root;
+    return true;
+
+}
+
+// no uvs, as before
+void moving_sphere::evaluate_surface(const ray& r, const hit_query& query, hit_record& rec) const {
+    rec.t = query.t;
     rec.p = r.at(rec.t);
     auto outward_normal = (rec.p - center(r.time())) / radius;
     rec.set_face_normal(r, outward_normal);
-    rec.mat_ptr = mat_ptr;
-
-    return true;
-
+    rec.u = rec.v = 0;
+    rec.mat_ptr = mat_ptr.get();
 }
 
 
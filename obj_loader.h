@@ -0,0 +1,450 @@
+#ifndef OBJ_LOADER_H
+#define OBJ_LOADER_H
+
+#include <vector>
+#include <string>
+#include <thread>
+#include <fstream>
+#include <iostream>
+#include <cstdint>
+#include <cstdlib>
+#include <cmath>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#include "rtweekend.h"
+#include "vec3.h"
+#include "vec2.h"
+
+
+// .obj reference  https://en.wikipedia.org/wiki/Wavefront_.obj_file
+// only v, vt, vn and f statements are read, everything else (groups, materials, lines) is skipped.
+//
+// the file is memory mapped, cut into line aligned chunks and each chunk is parsed on its own thread
+// into local vertex and face streams. once every chunk knows how many vertices it holds, a second
+// parallel pass resolves indices against the global counts (this is what makes negative, relative
+// indices work across chunk boundaries) and triangulates, and the chunks are finally concatenated in
+// file order, so the result is identical no matter how many threads did the work.
+
+
+// one triangle corner, zero based indices into obj_data, -1 when the face didn't give one
+struct obj_corner {
+    int v, vt, vn;
+};
+
+struct obj_data {
+    std::vector<point3> positions;
+    std::vector<vec2> uvs;
+    std::vector<vec3> normals;
+    std::vector<obj_corner> corners; // three per triangle
+    // four per quad: d0, d1, a, b. the quad is the triangles (d0, d1, a) and (d1, d0, b), which share
+    // the diagonal d0-d1, exactly the two triangles a triangulated quad would have produced
+    std::vector<obj_corner> quad_corners;
+    bool ok = false;
+
+    size_t triangle_count() const { return corners.size() / 3; }
+    size_t quad_count() const { return quad_corners.size() / 4; }
+};
+
+
+// read only view of a whole file, mapped where the platform allows it and read in otherwise
+class mapped_file {
+    public:
+        mapped_file(const char* filename){
+#if defined(__unix__) || defined(__APPLE__)
+            int fd = open(filename, O_RDONLY);
+            if(fd < 0) return;
+            struct stat st;
+            if(fstat(fd, &st) == 0 && st.st_size > 0){
+                void* p = mmap(nullptr, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+                if(p != MAP_FAILED){
+                    mapping = p;
+                    begin = (const char*)p;
+                    size = (size_t)st.st_size;
+                }
+            }
+            close(fd);
+            if(mapping) return;
+#endif
+            std::ifstream file(filename, std::ios::binary);
+            if(!file) return;
+            buffer.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+            begin = buffer.data();
+            size = buffer.size();
+        }
+
+        ~mapped_file(){
+#if defined(__unix__) || defined(__APPLE__)
+            if(mapping) munmap(mapping, size);
+#endif
+        }
+
+        mapped_file(const mapped_file&) = delete;
+        mapped_file& operator=(const mapped_file&) = delete;
+
+        bool is_open() const { return begin != nullptr; }
+
+    public:
+        const char* begin = nullptr;
+        size_t size = 0;
+
+    private:
+        void* mapping = nullptr;
+        std::vector<char> buffer;
+};
+
+
+namespace obj_detail {
+
+    inline bool is_space(char c){ return c == ' ' || c == '\t' || c == '\r'; }
+
+    inline const char* skip_space(const char* p, const char* end){
+        while(p < end && is_space(*p)) p++;
+        return p;
+    }
+
+    inline const char* skip_line(const char* p, const char* end){
+        while(p < end && *p != '\n') p++;
+        return p < end ? p + 1 : end;
+    }
+
+    // decimal float parser for the plain [-]digits[.digits][e[-]digits] numbers exporters write.
+    // anything it doesn't recognise (inf, nan, hex) goes to strtod
+    inline const char* parse_double(const char* p, const char* end, double& out){
+        static const double pow10[] = {1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10,
+                                       1e11, 1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22};
+        const char* start = p;
+        bool negative = false;
+        if(p < end && (*p == '-' || *p == '+')) negative = *p++ == '-';
+
+        uint64_t mantissa = 0;
+        int exponent = 0, digits = 0;
+        for(; p < end && *p >= '0' && *p <= '9'; p++, digits++){
+            if(mantissa < 100000000000000000ull) mantissa = mantissa * 10 + (*p - '0');
+            else exponent++;
+        }
+        if(p < end && *p == '.'){
+            for(p++; p < end && *p >= '0' && *p <= '9'; p++, digits++){
+                if(mantissa < 100000000000000000ull){
+                    mantissa = mantissa * 10 + (*p - '0');
+                    exponent--;
+                }
+            }
+        }
+
+        if(digits == 0){
+            char* stop;
+            std::string token(start, std::min(end, start + 64));
+            out = strtod(token.c_str(), &stop);
+            return start + (stop - token.c_str());
+        }
+
+        if(p < end && (*p == 'e' || *p == 'E')){
+            const char* q = p + 1;
+            bool exp_negative = false;
+            if(q < end && (*q == '-' || *q == '+')) exp_negative = *q++ == '-';
+            if(q < end && *q >= '0' && *q <= '9'){
+                int e = 0;
+                for(; q < end && *q >= '0' && *q <= '9'; q++) e = std::min(e * 10 + (*q - '0'), 10000);
+                exponent += exp_negative ? -e : e;
+                p = q;
+            }
+        }
+
+        double value = (double)mantissa;
+        if(exponent < 0){
+            value = exponent >= -22 ? value / pow10[-exponent] : value * std::pow(10.0, exponent);
+        }else if(exponent > 0){
+            value = exponent <= 22 ? value * pow10[exponent] : value * std::pow(10.0, exponent);
+        }
+        out = negative ? -value : value;
+        return p;
+    }
+
+    // returns 0 when there is no number here (an empty slot like the middle of "1//3")
+    inline const char* parse_index(const char* p, const char* end, int& out){
+        bool negative = false;
+        if(p < end && *p == '-'){
+            negative = true;
+            p++;
+        }
+        int value = 0;
+        for(; p < end && *p >= '0' && *p <= '9'; p++) value = value * 10 + (*p - '0');
+        out = negative ? -value : value;
+        return p;
+    }
+
+    // raw face corner as written in the file: 1 based, negative counts back from the latest vertex
+    struct raw_corner {
+        int v, vt, vn;
+    };
+
+    // a face remembers how many vertices its chunk had seen so far, which is what its relative
+    // indices count back from
+    struct raw_face {
+        uint32_t first_corner;
+        uint32_t corner_count;
+        uint32_t v_seen, vt_seen, vn_seen;
+    };
+
+    struct chunk_result {
+        std::vector<point3> positions;
+        std::vector<vec2> uvs;
+        std::vector<vec3> normals;
+        std::vector<raw_corner> raw_corners;
+        std::vector<raw_face> faces;
+        std::vector<obj_corner> corners;
+        std::vector<obj_corner> quad_corners;
+    };
+
+    inline void parse_chunk(const char* p, const char* end, chunk_result& out){
+        while(p < end){
+            p = skip_space(p, end);
+            if(p >= end) break;
+
+            if(p[0] == 'v' && p + 1 < end && is_space(p[1])){
+                point3 v;
+                p += 2;
+                for(int k = 0; k < 3; k++) p = parse_double(skip_space(p, end), end, v[k]);
+                out.positions.push_back(v);
+            }else if(p[0] == 'v' && p + 2 < end && p[1] == 't' && is_space(p[2])){
+                vec2 uv;
+                p += 3;
+                for(int k = 0; k < 2; k++) p = parse_double(skip_space(p, end), end, uv[k]);
+                out.uvs.push_back(uv);
+            }else if(p[0] == 'v' && p + 2 < end && p[1] == 'n' && is_space(p[2])){
+                vec3 n;
+                p += 3;
+                for(int k = 0; k < 3; k++) p = parse_double(skip_space(p, end), end, n[k]);
+                out.normals.push_back(n);
+            }else if(p[0] == 'f' && p + 1 < end && is_space(p[1])){
+                raw_face face;
+                face.first_corner = (uint32_t)out.raw_corners.size();
+                face.v_seen = (uint32_t)out.positions.size();
+                face.vt_seen = (uint32_t)out.uvs.size();
+                face.vn_seen = (uint32_t)out.normals.size();
+                p++;
+
+                while(true){
+                    p = skip_space(p, end);
+                    if(p >= end || *p == '\n' || *p == '#') break;
+
+                    raw_corner c = {0, 0, 0};
+                    p = parse_index(p, end, c.v);
+                    if(p < end && *p == '/'){
+                        p = parse_index(p + 1, end, c.vt);
+                        if(p < end && *p == '/') p = parse_index(p + 1, end, c.vn);
+                    }
+                    // skip whatever is left of a malformed token
+                    while(p < end && !is_space(*p) && *p != '\n') p++;
+
+                    if(c.v != 0) out.raw_corners.push_back(c);
+                }
+
+                face.corner_count = (uint32_t)out.raw_corners.size() - face.first_corner;
+                if(face.corner_count >= 3) out.faces.push_back(face);
+                else out.raw_corners.resize(face.first_corner);
+            }
+
+            p = skip_line(p, end);
+        }
+    }
+
+    inline int resolve(int raw, uint32_t seen, uint32_t base){
+        if(raw > 0) return raw - 1;
+        if(raw < 0) return (int)(base + seen) + raw;
+        return -1;
+    }
+
+    // emits tri (a, b, c) in the orientation the winding asks for
+    inline void emit(std::vector<obj_corner>& out, const obj_corner& cur, const obj_corner& prev, const obj_corner& next, int winding){
+        out.push_back(cur);
+        out.push_back(winding < 0 ? next : prev);
+        out.push_back(winding < 0 ? prev : next);
+    }
+
+    // ear clipping over a circular linked list, so clipping an ear is O(1) instead of an erase.
+    // convexity is judged against the polygon's Newell normal, which is right for either vertex order
+    // and doesn't need the file to carry normals at all
+    // convex quads are kept whole and go to quads_out, everything else is cut into triangles
+    inline void triangulate(const obj_corner* poly, int n, const std::vector<point3>& positions, int winding,
+                            std::vector<obj_corner>& out, std::vector<obj_corner>& quads_out){
+        auto pos = [&](int k) -> const point3& { return positions[poly[k].v]; };
+
+        vec3 normal(0,0,0);
+        for(int k = 0; k < n; k++){
+            const point3& a = pos(k);
+            const point3& b = pos((k + 1) % n);
+            normal += vec3((a.y() - b.y()) * (a.z() + b.z()),
+                           (a.z() - b.z()) * (a.x() + b.x()),
+                           (a.x() - b.x()) * (a.y() + b.y()));
+        }
+
+        auto convex = [&](int prev, int cur, int next){
+            return dot(cross(pos(cur) - pos(prev), pos(next) - pos(cur)), normal) > 0;
+        };
+
+        // quads are almost always convex, and then the 1-3 diagonal splits them without any search.
+        // the first triangle is the 0 ear as emit() orders it, its last two corners are the diagonal
+        if(n == 4 && convex(3, 0, 1) && convex(1, 2, 3)){
+            size_t first = quads_out.size();
+            emit(quads_out, poly[0], poly[3], poly[1], winding);
+            obj_corner a = quads_out[first];
+            quads_out[first] = quads_out[first + 1];
+            quads_out[first + 1] = quads_out[first + 2];
+            quads_out[first + 2] = a;
+            quads_out.push_back(poly[2]);
+            return;
+        }
+
+        std::vector<int> prev(n), next(n);
+        for(int k = 0; k < n; k++){
+            prev[k] = (k + n - 1) % n;
+            next[k] = (k + 1) % n;
+        }
+
+        auto inside = [&](int a, int b, int c, int p){
+            return dot(cross(pos(b) - pos(a), pos(p) - pos(a)), normal) >= 0
+                && dot(cross(pos(c) - pos(b), pos(p) - pos(b)), normal) >= 0
+                && dot(cross(pos(a) - pos(c), pos(p) - pos(c)), normal) >= 0;
+        };
+
+        int remaining = n, cur = 0, misses = 0;
+        while(remaining > 3){
+            int a = prev[cur], c = next[cur];
+            bool ear = convex(a, cur, c);
+            for(int k = next[c]; ear && k != a; k = next[k]){
+                if(inside(a, cur, c, k)) ear = false;
+            }
+
+            // a degenerate or self intersecting polygon may have no proper ear left, clip anyway
+            // rather than spin forever
+            if(ear || misses > remaining){
+                emit(out, poly[cur], poly[a], poly[c], winding);
+                next[a] = c;
+                prev[c] = a;
+                remaining--;
+                misses = 0;
+                cur = c;
+            }else{
+                misses++;
+                cur = c;
+            }
+        }
+
+        emit(out, poly[cur], poly[prev[cur]], poly[next[cur]], winding);
+    }
+}
+
+
+// winding picks the orientation of the emitted triangles, as triangle_mesh always took it:
+// -1 keeps the file's vertex order, 1 reverses it
+inline obj_data load_obj(const char* filename, int winding){
+    using namespace obj_detail;
+
+    obj_data result;
+    mapped_file file(filename);
+    if(!file.is_open()){
+        std::cerr << "There was a problem with reading the mesh file " << filename << ".\n";
+        return result;
+    }
+
+    const char* data = file.begin;
+    const char* data_end = file.begin + file.size;
+
+    // chunks of at least 1MB, so small files stay on one thread
+    unsigned int hw = std::thread::hardware_concurrency();
+    size_t chunk_count = std::max<size_t>(1, std::min<size_t>(hw == 0 ? 1 : hw, file.size >> 20));
+
+    std::vector<const char*> bounds(chunk_count + 1);
+    bounds[0] = data;
+    bounds[chunk_count] = data_end;
+    for(size_t k = 1; k < chunk_count; k++){
+        const char* p = std::max(bounds[k - 1], data + file.size * k / chunk_count);
+        bounds[k] = (p == data) ? p : skip_line(p - 1, data_end);
+    }
+
+    auto for_each_chunk = [&](auto&& work){
+        std::vector<std::thread> threads;
+        for(size_t k = 1; k < chunk_count; k++) threads.emplace_back(work, k);
+        work(0);
+        for(auto& th : threads) th.join();
+    };
+
+    std::vector<chunk_result> chunks(chunk_count);
+    for_each_chunk([&](size_t k){ parse_chunk(bounds[k], bounds[k + 1], chunks[k]); });
+
+    // global offsets of every chunk's vertex streams
+    std::vector<uint32_t> v_base(chunk_count), vt_base(chunk_count), vn_base(chunk_count);
+    size_t v_total = 0, vt_total = 0, vn_total = 0;
+    for(size_t k = 0; k < chunk_count; k++){
+        v_base[k] = (uint32_t)v_total;
+        vt_base[k] = (uint32_t)vt_total;
+        vn_base[k] = (uint32_t)vn_total;
+        v_total += chunks[k].positions.size();
+        vt_total += chunks[k].uvs.size();
+        vn_total += chunks[k].normals.size();
+    }
+
+    result.positions.reserve(v_total);
+    result.uvs.reserve(vt_total);
+    result.normals.reserve(vn_total);
+    for(auto& chunk : chunks){
+        result.positions.insert(result.positions.end(), chunk.positions.begin(), chunk.positions.end());
+        result.uvs.insert(result.uvs.end(), chunk.uvs.begin(), chunk.uvs.end());
+        result.normals.insert(result.normals.end(), chunk.normals.begin(), chunk.normals.end());
+        chunk.positions = std::vector<point3>();
+        chunk.uvs = std::vector<vec2>();
+        chunk.normals = std::vector<vec3>();
+    }
+
+    for_each_chunk([&](size_t k){
+        chunk_result& chunk = chunks[k];
+        std::vector<obj_corner> poly;
+
+        for(const raw_face& face : chunk.faces){
+            poly.clear();
+            bool valid = true;
+            for(uint32_t c = 0; c < face.corner_count; c++){
+                const raw_corner& raw = chunk.raw_corners[face.first_corner + c];
+                obj_corner corner = {resolve(raw.v, face.v_seen, v_base[k]),
+                                     resolve(raw.vt, face.vt_seen, vt_base[k]),
+                                     resolve(raw.vn, face.vn_seen, vn_base[k])};
+                valid = valid && corner.v >= 0 && corner.v < (int)v_total
+                              && corner.vt >= -1 && corner.vt < (int)vt_total
+                              && corner.vn >= -1 && corner.vn < (int)vn_total;
+                poly.push_back(corner);
+            }
+            if(!valid) continue;
+
+            if(poly.size() == 3) emit(chunk.corners, poly[0], poly[2], poly[1], winding);
+            else triangulate(poly.data(), (int)poly.size(), result.positions, winding, chunk.corners, chunk.quad_corners);
+        }
+
+        chunk.raw_corners = std::vector<raw_corner>();
+        chunk.faces = std::vector<raw_face>();
+    });
+
+    size_t corner_total = 0, quad_corner_total = 0;
+    for(auto& chunk : chunks){
+        corner_total += chunk.corners.size();
+        quad_corner_total += chunk.quad_corners.size();
+    }
+    result.corners.reserve(corner_total);
+    result.quad_corners.reserve(quad_corner_total);
+    for(auto& chunk : chunks){
+        result.corners.insert(result.corners.end(), chunk.corners.begin(), chunk.corners.end());
+        result.quad_corners.insert(result.quad_corners.end(), chunk.quad_corners.begin(), chunk.quad_corners.end());
+    }
+
+    result.ok = true;
+    return result;
+}
+
+
+#endif
@@ -19,11 +19,20 @@ class pdf {
 
 };
 
+// multiple importance sampling weight of a sample drawn with pdf f, when another strategy could
+// have drawn it with pdf g (power heuristic, exponent 2). the weights of both strategies sum to one
+inline double power_heuristic(double f, double g){
+    double f2 = f * f, g2 = g * g;
+    return f2 + g2 > 0 ? f2 / (f2 + g2) : 0;
+}
+
+// non-owning: both pdfs must outlive the mixture, which in practice means they all live on the
+// stack of the same bounce
 class mixture_pdf : public pdf{
     public:
-        mixture_pdf(shared_ptr<pdf> p0, shared_ptr<pdf> p1) {
-            p[0] = p0;
-            p[1] = p1;
+        mixture_pdf(const pdf& p0, const pdf& p1) {
+            p[0] = &p0;
+            p[1] = &p1;
         }
 
         virtual double value(const vec3& direction) const override {
@@ -38,13 +47,14 @@ class mixture_pdf : public pdf{
         }
 
     public:
-        shared_ptr<pdf> p[2];
+        const pdf* p[2];
 
 };
 
 class cosine_pdf : public pdf {
 
     public: 
+        cosine_pdf(){}
         cosine_pdf(const vec3& normal){
             local_basis.build_from_normal(normal);
         }
@@ -82,7 +92,7 @@ class sphere_pdf : public pdf{
 
 class hittable_pdf : public pdf {
     public:
-        hittable_pdf(shared_ptr<hittable> p, const point3& origin) : o(origin), ptr(p) {}
+        hittable_pdf(const hittable& p, const point3& origin) : o(origin), ptr(&p) {}
         
         virtual double value(const vec3& direction) const override {
             return ptr->pdf_value(o, direction);
@@ -94,12 +104,58 @@ class hittable_pdf : public pdf {
     
     public:
         point3 o;
-        shared_ptr<hittable> ptr;
+        const hittable* ptr;
 
 
 };
 
 
+/*
+Direction distribution a material hands back from scatter(). It is a small tagged struct: a tag
+plus one member for each distribution materials use, of which only the tagged one is set up. It is
+stored by value in the scatter_record so that scattering never allocates; value() and generate()
+dispatch on the tag instead of through a heap allocated pdf.
+*/
+class scatter_pdf : public pdf {
+    public:
+        enum kind { none, cosine, uniform_sphere };
+
+        scatter_pdf() : type(none) {}
+
+        void set_none() { type = none; }
+
+        void set_cosine(const vec3& normal) {
+            type = cosine;
+            cos_pdf.local_basis.build_from_normal(normal);
+        }
+
+        void set_uniform_sphere() { type = uniform_sphere; }
+
+        virtual double value(const vec3& direction) const override {
+            switch(type){
+                case cosine:         return cos_pdf.cosine_pdf::value(direction);
+                case uniform_sphere: return sph_pdf.sphere_pdf::value(direction);
+                default:             return 0;
+            }
+        }
+
+        virtual vec3 generate() const override {
+            switch(type){
+                case cosine:         return cos_pdf.cosine_pdf::generate();
+                case uniform_sphere: return sph_pdf.sphere_pdf::generate();
+                default:             return vec3(1,0,0);
+            }
+        }
+
+    public:
+        kind type;
+
+    private:
+        cosine_pdf cos_pdf;
+        sphere_pdf sph_pdf;
+};
+
+
 
 
 #endif
\ No newline at end of file
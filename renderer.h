@@ -0,0 +1,231 @@
+#ifndef RENDERER_H
+#define RENDERER_H
+
+#include <vector>
+#include <deque>
+#include <algorithm>
+#include <mutex>
+#include <thread>
+#include <atomic>
+#include <functional>
+#include <iostream>
+
+#include "rtweekend.h"
+#include "vec3.h"
+#include "framebuffer.h"
+
+
+// half open pixel rectangle [x0,x1) x [y0,y1)
+struct tile {
+    int x0, y0;
+    int x1, y1;
+};
+
+
+// work stealing tile queue
+// each worker owns a deque. it pops tiles off the front of its own deque and, once that runs dry,
+// steals from the back of the other workers' deques. tiles are handed out in contiguous runs so
+// neighbouring tiles (and the geometry they see) tend to stay on the same core.
+class tile_scheduler {
+    public:
+        tile_scheduler(int image_width, int image_height, int tile_size, int workers) : queues(workers) {
+            std::vector<tile> tiles;
+            for(int y = image_height; y > 0; y -= tile_size){
+                for(int x = 0; x < image_width; x += tile_size){
+                    tiles.push_back({x, std::max(0, y - tile_size), std::min(image_width, x + tile_size), y});
+                }
+            }
+
+            total = (int)tiles.size();
+            for(int w = 0; w < workers; w++){
+                size_t first = tiles.size() * w / workers;
+                size_t last = tiles.size() * (w + 1) / workers;
+                queues[w].tiles.assign(tiles.begin() + first, tiles.begin() + last);
+            }
+        }
+
+        bool next(int worker, tile& t){
+            if(pop_front(worker, t)) return true;
+
+            int workers = (int)queues.size();
+            for(int k = 1; k < workers; k++){
+                if(steal_back((worker + k) % workers, t)) return true;
+            }
+
+            return false;
+        }
+
+    public:
+        int total;
+
+    private:
+        struct worker_queue {
+            std::mutex lock;
+            std::deque<tile> tiles;
+        };
+
+        std::vector<worker_queue> queues;
+
+        bool pop_front(int worker, tile& t){
+            std::lock_guard<std::mutex> guard(queues[worker].lock);
+            if(queues[worker].tiles.empty()) return false;
+            t = queues[worker].tiles.front();
+            queues[worker].tiles.pop_front();
+            return true;
+        }
+
+        bool steal_back(int victim, tile& t){
+            std::lock_guard<std::mutex> guard(queues[victim].lock);
+            if(queues[victim].tiles.empty()) return false;
+            t = queues[victim].tiles.back();
+            queues[victim].tiles.pop_back();
+            return true;
+        }
+};
+
+
+// adaptive per pixel sampling. samples are drawn in batches while a running (Welford) variance of the
+// pixel's luminance is kept; the pixel stops once the standard error of its mean falls below
+// target_error times that mean, a relative error, which is roughly what the eye sees as noise.
+// luminance_floor stands in for the mean of near black pixels, whose relative error would otherwise
+// take forever to come down. a render runs two passes over a fixed budget: every pixel gets up to the
+// per pixel budget, then the samples the easy pixels left over are shared out among the pixels that
+// are still noisy (see share_spare), up to max_samples each.
+struct adaptive_sampling {
+    int min_samples = 64;
+    int max_samples = 1024;
+    double target_error = 0.02;
+    double luminance_floor = 0.05;
+    int batch_size = 8;
+
+    // everything known about one pixel so far, carried from one pass to the next
+    struct pixel_estimate {
+        color sum = color(0,0,0);
+        double mean_lum = 0, m2 = 0;
+        int n = 0;
+
+        color mean() const { return n > 0 ? sum / n : color(0,0,0); }
+    };
+
+    // standard error of the mean luminance over the error it may have, at most 1 once converged
+    double error_ratio(const pixel_estimate& p) const {
+        if(p.n < 2) return infinity;
+        double std_error = sqrt(p.m2 / (p.n - 1) / p.n);
+        return std_error / (target_error * fmax(p.mean_lum, luminance_floor));
+    }
+
+    bool converged(const pixel_estimate& p) const {
+        return p.n >= min_samples && error_ratio(p) <= 1;
+    }
+
+    // whether sample 'index' of a pixel, drawn after starting the pixel over the way render_tiles does,
+    // differs from sample 0 of the pixel's first visit. the second pass resumes every pixel like that,
+    // and a sampler that replayed the first pass there would repeat samples and fake a low variance
+    static bool resumes_fresh(sampler& s, uint64_t pixel, uint32_t index){
+        auto first_dimensions = [&](uint32_t k){
+            set_random_stream(pixel + 1);
+            s.start_pixel(pixel);
+            s.start_sample(k);
+            std::vector<double> values(4);
+            for(double& x : values) x = s.next_1d();
+            return values;
+        };
+        return first_dimensions(0) != first_dimensions(index);
+    }
+
+    // draws sample(index) for the next indices of the pixel until it converges or holds limit samples
+    void refine(const std::function<color(uint32_t)>& sample, pixel_estimate& p, int limit) const {
+        while(p.n < limit && !converged(p)){
+            int batch_end = std::min(limit, p.n < min_samples ? min_samples : p.n + batch_size);
+            while(p.n < batch_end){
+                color c = sample((uint32_t)p.n);
+                p.n++;
+                // deal with pesky NaNs, they count as black samples
+                if(c.r() != c.r() || c.g() != c.g() || c.b() != c.b()) c = color(0,0,0);
+                p.sum += c;
+
+                // clamped like the output will be, so lone fireflies don't keep a pixel sampling forever
+                double lum = fmin(0.2126 * c.r() + 0.7152 * c.g() + 0.0722 * c.b(), 1.0);
+                double delta = lum - p.mean_lum;
+                p.mean_lum += delta / p.n;
+                p.m2 += delta * (lum - p.mean_lum);
+            }
+        }
+    }
+
+    // sample limits for the second pass. the error falls as 1/sqrt(n), so a pixel at error ratio r
+    // needs about n (r^2 - 1) more samples. each unconverged pixel asks for that much (within
+    // max_samples), and when the spare samples of budget do not cover every request they are all
+    // scaled down alike
+    std::vector<int> share_spare(const std::vector<pixel_estimate>& pixels, long long budget) const {
+        std::vector<int> limits(pixels.size());
+        std::vector<double> wanted(pixels.size(), 0);
+        double spare = (double)budget, total_wanted = 0;
+        for(size_t k = 0; k < pixels.size(); k++){
+            const pixel_estimate& p = pixels[k];
+            spare -= p.n;
+            limits[k] = p.n;
+            if(converged(p) || p.n >= max_samples) continue;
+            double r = error_ratio(p);
+            wanted[k] = fmin(p.n * (r * r - 1), (double)(max_samples - p.n));
+            total_wanted += wanted[k];
+        }
+
+        double scale = total_wanted > spare ? fmax(spare, 0.0) / total_wanted : 1.0;
+        for(size_t k = 0; k < pixels.size(); k++) limits[k] += (int)(wanted[k] * scale);
+        return limits;
+    }
+};
+
+
+inline int render_thread_count(){
+    unsigned int n = std::thread::hardware_concurrency();
+    return n == 0 ? 1 : (int)n;
+}
+
+
+// renders every pixel of fb with shade_pixel(i, j) using a pool of threads pulling tiles from
+// a tile_scheduler. returns once the whole image is finished. tile_done, when given, is called by
+// the thread that rendered a tile right after its last pixel, while other tiles are still in flight
+void render_tiles(framebuffer& fb, const std::function<color(int, int)>& shade_pixel,
+                  const std::function<void(const tile&)>& tile_done = nullptr,
+                  int tile_size = 32, int num_threads = render_thread_count()){
+
+    tile_scheduler scheduler(fb.width, fb.height, tile_size, num_threads);
+    std::atomic<int> tiles_done(0);
+    std::mutex progress_lock;
+
+    auto worker = [&](int id){
+        tile t;
+        while(scheduler.next(id, t)){
+            for(int j = t.y1 - 1; j >= t.y0; j--){
+                for(int i = t.x0; i < t.x1; i++){
+                    // stream 0 belongs to scene construction
+                    set_random_stream((uint64_t)j * fb.width + i + 1);
+                    fb.at(i, j) = shade_pixel(i, j);
+                }
+            }
+
+            if(tile_done) tile_done(t);
+
+            int done = ++tiles_done;
+            std::lock_guard<std::mutex> guard(progress_lock);
+            std::cerr << "\rTiles remaining: " << scheduler.total - done << ' ' << std::flush;
+        }
+    };
+
+    std::vector<std::thread> threads;
+    for(int k = 1; k < num_threads; k++){
+        threads.emplace_back(worker, k);
+    }
+    worker(0);
+
+    for(auto& th : threads){
+        th.join();
+    }
+
+    std::cerr << "\nDone.\n";
+}
+
+
+#endif
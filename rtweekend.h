@@ -6,6 +6,7 @@
 #include <memory>
 #include <limits>
 #include <cstdlib>
+#include <cstdint>
 
 
 using std::shared_ptr;
@@ -23,9 +24,102 @@ inline double degrees_to_radians(double degrees){
     return degrees * pi / 180;
 }
 
+/*
+Counter based random numbers. The n-th draw of a stream is mix(key + n * gamma) (splitmix64), so a
+stream is completely determined by its key. Every thread owns its generator, and the renderer rekeys it
+from (seed, pixel) before each pixel, which makes an image bit-identical for a given seed no matter how
+many threads render it or in what order the tiles are picked up.
+*/
+class rng {
+    public:
+        rng(uint64_t seed = 0, uint64_t stream = 0) { set_stream(seed, stream); }
+
+        void set_stream(uint64_t seed, uint64_t stream){
+            state = mix(seed ^ mix(stream + gamma));
+        }
+
+        uint64_t next_u64(){
+            state += gamma;
+            return mix(state);
+        }
+
+        // 53 random mantissa bits, in [0,1)
+        double next_double(){
+            return (next_u64() >> 11) * 0x1.0p-53;
+        }
+
+    private:
+        static const uint64_t gamma = 0x9E3779B97F4A7C15ull;
+        uint64_t state;
+
+        static uint64_t mix(uint64_t z){
+            z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+            z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+            return z ^ (z >> 31);
+        }
+};
+
+inline uint64_t& random_seed(){
+    static uint64_t seed = 0;
+    return seed;
+}
+
+inline rng& thread_rng(){
+    static thread_local rng generator(random_seed());
+    return generator;
+}
+
+// sets the seed of the whole render and restarts the calling thread (scene construction) on it
+inline void seed_random(uint64_t seed){
+    random_seed() = seed;
+    thread_rng().set_stream(seed, 0);
+}
+
+// switch the calling thread to stream 'stream' of the current seed, e.g. one stream per pixel
+inline void set_random_stream(uint64_t stream){
+    thread_rng().set_stream(random_seed(), stream);
+}
+
+/*
+Source of the sample values of a render (see sampler.h). While a sampler is bound to a thread, every
+random_double() of that thread reads the next dimension of the sampler's current sample, so the camera,
+the materials, the light choice and russian roulette all draw from it without being handed one.
+Without a bound sampler (scene construction, for one) random_double() reads thread_rng() directly.
+*/
+class sampler {
+    public:
+        virtual ~sampler() {}
+
+        // first sample of pixel 'pixel', and sample 'index' of that pixel
+        virtual void start_pixel(uint64_t pixel) = 0;
+        virtual void start_sample(uint32_t index) = 0;
+
+        // next dimension of the current sample, in [0,1)
+        virtual double next_1d() = 0;
+};
+
+inline sampler*& bound_sampler(){
+    static thread_local sampler* current = nullptr;
+    return current;
+}
+
+// binds s to the calling thread for as long as it lives
+class scoped_sampler {
+    public:
+        scoped_sampler(sampler& s) : previous(bound_sampler()) { bound_sampler() = &s; }
+        ~scoped_sampler() { bound_sampler() = previous; }
+
+        scoped_sampler(const scoped_sampler&) = delete;
+        scoped_sampler& operator=(const scoped_sampler&) = delete;
+
+    private:
+        sampler* previous;
+};
+
 inline double random_double(){
     // return random number in [0,1)
-    return rand() / (RAND_MAX + 1.0);
+    sampler* s = bound_sampler();
+    return s ? s->next_1d() : thread_rng().next_double();
 }
 
 inline double random_double(double min, double max){
@@ -0,0 +1,125 @@
+#ifndef SAMPLER_H
+#define SAMPLER_H
+
+#include <cstdint>
+
+#include "rtweekend.h"
+
+
+// plain pseudo random samples from the thread's rng. every sample rekeys it from the pixel and the
+// sample index, so sample n of a pixel is the same whenever it is drawn, and a pixel picked up again
+// later (the second adaptive pass) continues with fresh samples instead of replaying the first ones
+class independent_sampler : public sampler {
+    public:
+        virtual void start_pixel(uint64_t pixel) override {
+            pixel_seed = rng(random_seed(), pixel).next_u64();
+        }
+
+        virtual void start_sample(uint32_t index) override {
+            thread_rng().set_stream(pixel_seed, index);
+        }
+
+        virtual double next_1d() override {
+            return thread_rng().next_double();
+        }
+
+    private:
+        uint64_t pixel_seed = 0;
+};
+
+
+/*
+Owen scrambled Sobol samples, after Burley, "Practical Hash-based Owen Scrambling" (JCGT 2020).
+Dimensions are taken in pairs and every pair is its own copy of the first two Sobol dimensions, a
+(0,2) sequence, so any 2D projection a path looks at (pixel position, lens, a bounce direction) is
+stratified at every power of two and still well spread in between. Each pair shuffles the sample
+index and scrambles the point with seeds hashed from the pixel and the pair, which decorrelates the
+pairs from each other and neighbouring pixels from each other while keeping each pair's
+stratification.
+Samples are exact for any count: sample n of a pixel is just point n of its sequences, so no
+sample is dropped to make a square grid.
+*/
+class sobol_sampler : public sampler {
+    public:
+        virtual void start_pixel(uint64_t pixel) override {
+            pixel_seed = rng(random_seed(), pixel).next_u64();
+        }
+
+        virtual void start_sample(uint32_t index) override {
+            reversed_index = reverse_bits(index);
+            dimension = 0;
+        }
+
+        // the work happens on bit reversed values, where an owen scramble (nested uniform scrambling)
+        // is a single laine_karras_permutation and the first Sobol dimension is the index itself
+        virtual double next_1d() override {
+            uint32_t pair = dimension / 2, axis = dimension % 2;
+            dimension++;
+
+            if(axis == 0) shuffled_index = reverse_bits(laine_karras_permutation(reversed_index, hash(pair, 0)));
+            uint32_t x = axis == 0 ? shuffled_index : sobol_1_reversed(shuffled_index);
+            x = reverse_bits(laine_karras_permutation(x, hash(pair, 1 + axis)));
+
+            // 32 bits, exactly representable, so the result stays below 1
+            return x * 0x1.0p-32;
+        }
+
+    private:
+        uint64_t pixel_seed = 0;
+        uint32_t reversed_index = 0;
+        uint32_t dimension = 0;
+        uint32_t shuffled_index = 0;
+
+        // seed of one scramble, a single multiply-xorshift round over the pixel seed
+        uint32_t hash(uint32_t pair, uint32_t salt) const {
+            uint64_t z = pixel_seed ^ (((uint64_t)pair << 2 | salt) * 0x9E3779B97F4A7C15ull);
+            z = (z ^ (z >> 31)) * 0xBF58476D1CE4E5B9ull;
+            return (uint32_t)(z >> 32);
+        }
+
+        static uint32_t reverse_bits(uint32_t x){
+            x = (x << 16) | (x >> 16);
+            x = ((x & 0x00ff00ffu) << 8) | ((x & 0xff00ff00u) >> 8);
+            x = ((x & 0x0f0f0f0fu) << 4) | ((x & 0xf0f0f0f0u) >> 4);
+            x = ((x & 0x33333333u) << 2) | ((x & 0xccccccccu) >> 2);
+            x = ((x & 0x55555555u) << 1) | ((x & 0xaaaaaaaau) >> 1);
+            return x;
+        }
+
+        // second Sobol dimension, bit reversed. its generator matrix is pascal's triangle mod 2, so bit j
+        // of the result is the xor of the index bits i that contain j (i & j == j), a superset transform
+        static uint32_t sobol_1_reversed(uint32_t index){
+            index ^= (index >> 1) & 0x55555555u;
+            index ^= (index >> 2) & 0x33333333u;
+            index ^= (index >> 4) & 0x0f0f0f0fu;
+            index ^= (index >> 8) & 0x00ff00ffu;
+            index ^= (index >> 16) & 0x0000ffffu;
+            return index;
+        }
+
+        // a hash in which every bit only depends on the bits below it. applied to the reversed value
+        // every bit gets flipped depending on the bits above it only, which is an owen scramble
+        static uint32_t laine_karras_permutation(uint32_t x, uint32_t seed){
+            x += seed;
+            x ^= x * 0x6c50b47cu;
+            x ^= x * 0xb82f1e52u;
+            x ^= x * 0xc7afe638u;
+            x ^= x * 0x8d22f6e6u;
+            return x;
+        }
+};
+
+
+enum class sampler_type { independent, sobol };
+
+// the calling thread's sampler of the given type. each render thread gets its own, they keep state
+// between draws
+inline sampler& thread_sampler(sampler_type type){
+    static thread_local independent_sampler independent;
+    static thread_local sobol_sampler sobol;
+    if(type == sampler_type::sobol) return sobol;
+    return independent;
+}
+
+
+#endif
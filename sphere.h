@@ -3,22 +3,34 @@
 
 #include "hittable.h"
 #include "ray.h"
+#include "material.h"
+#include "onb.h"
 
 class sphere : public hittable {
     public:
         sphere(){}
         sphere(point3 cen, double r, shared_ptr<material> m) : center(cen), radius(r), mat_ptr(m) {};
 
-        virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const override;
+        virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const override {
+            return deferred_hit(r, t_min, t_max, rec);
+        }
+        virtual bool intersect(const ray& r, double t_min, double t_max, hit_query& query, hit_record& rec) const override;
+        virtual void evaluate_surface(const ray& r, const hit_query& query, hit_record& rec) const override;
         virtual bool bounding_box(double time0, double time1, aabb& output_box) const override;
 
+        virtual double pdf_value(const point3& o, const vec3& v) const override;
+        virtual vec3 random(const point3& o) const override;
+
+        virtual void collect_emitters(const shared_ptr<hittable>& self, std::vector<emitter>& out) const override {
+            collect_if_emitting(self, *mat_ptr, 4 * pi * radius * radius, out);
+        }
+
 
     public:
         point3 center;
         double radius;
         shared_ptr<material> mat_ptr;
 
-    private:
         // manifold chart of sphere which generates [0,1] - normalized theta phi coordinates
         // u: normalized phi coord 
         // v: normalized theta coord
@@ -35,7 +47,7 @@ class sphere : public hittable {
 
 };
 
-bool sphere::hit(const ray& r, double t_min, double t_max, hit_record& rec) const {
+bool sphere::intersect(const ray& r, double t_min, double t_max, hit_query& query, hit_record&) const {
 
     point3 op = r.origin() - center;
     double c = dot(op,op) - radius * radius;
@@ -55,23 +67,56 @@ bool sphere::hit(const ray& r, double t_min, double t_max, hit_record& rec) cons
         }
     }
 
-    rec.t = zero;
-    rec.p = r.at(zero);
-    auto outward_normal = (r.at(zero) - center) / radius;
-    rec.set_face_normal(r, outward_normal);
-    get_sphere_uv(outward_normal, rec.u, rec.v);
-    rec.mat_ptr = mat_ptr;
-    
-
+    query.t = zero;
     return true;
 
 }
 
+void sphere::evaluate_surface(const ray& r, const hit_query& query, hit_record& rec) const {
+    rec.t = query.t;
+    rec.p = r.at(rec.t);
+    auto outward_normal = (rec.p - center) / radius;
+    rec.set_face_normal(r, outward_normal);
+    get_sphere_uv(outward_normal, rec.u, rec.v);
+    rec.mat_ptr = mat_ptr.get();
+}
+
 bool sphere::bounding_box(double time0, double time1, aabb& output_box) const{
     output_box  = aabb(center - point3(radius,radius,radius), center + point3(radius,radius,radius));  
     return true;
 }
 
+// directions are sampled uniformly within the cone the sphere subtends from o. from inside it covers
+// every direction, so those are uniform over the sphere of directions
+double sphere::pdf_value(const point3& o, const vec3& v) const {
+    double distance_squared = (center - o).length_squared();
+    if(distance_squared <= radius * radius) return 1 / (4 * pi);
+
+    hit_query query;
+    hit_record rec;
+    if(!this->intersect(ray(o, v), 0.001, infinity, query, rec)) return 0;
+
+    double cos_theta_max = sqrt(1 - radius * radius / distance_squared);
+    return 1 / (2 * pi * (1 - cos_theta_max));
+}
+
+vec3 sphere::random(const point3& o) const {
+    vec3 direction = center - o;
+    double distance_squared = direction.length_squared();
+    if(distance_squared <= radius * radius) return random_unit_vector();
+
+    double r1 = random_double();
+    double r2 = random_double();
+    double cos_theta_max = sqrt(1 - radius * radius / distance_squared);
+    double z = 1 + r2 * (cos_theta_max - 1);
+    double phi = 2 * pi * r1;
+    double sin_theta = sqrt(1 - z * z);
+
+    onb uvw;
+    uvw.build_from_normal(direction);
+    return uvw.local(cos(phi) * sin_theta, sin(phi) * sin_theta, z);
+}
+
 
 
 
@@ -0,0 +1,289 @@
+#ifndef SPHERE_SET_H
+#define SPHERE_SET_H
+
+#include <vector>
+#include <unordered_map>
+#include <cstdint>
+#include <limits>
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#endif
+
+#include "rtweekend.h"
+#include "hittable.h"
+#include "bvh.h"
+#include "sphere.h"
+
+
+/*
+Up to four spheres laid out structure of arrays. Everything is double precision: the ground sphere of a
+typical scene has a radius of 1000 and loses its surface entirely in float. With SSE2 that makes each
+instruction cover two lanes, so a packet takes two of them. Unused lanes have a NaN radius, which
+fails every comparison.
+Motion is kept apart in a sphere_motion, so static spheres (most of them in a typical scene) neither
+store it nor pull it into cache. With motion, the center at time t is center + velocity * (t - time0),
+evaluated in the same order as moving_sphere so both give bit identical hits.
+*/
+struct alignas(16) sphere_motion {
+    double velocity[3][4];
+    double time0[4];
+};
+
+struct alignas(16) sphere_packet {
+    double center[3][4];
+    double radius[4];
+    uint32_t material[4];
+    uint32_t motion; // index into the set's motions, or no_motion
+    uint32_t pad[3];
+
+    static const uint32_t no_motion = 0xffffffff;
+
+    sphere_packet() : center{}, material{}, motion(no_motion), pad{} {
+        for(int i = 0; i < 4; i++) radius[i] = std::numeric_limits<double>::quiet_NaN();
+    }
+
+    point3 center_at(int lane, double time, const sphere_motion* m) const {
+        point3 c(center[0][lane], center[1][lane], center[2][lane]);
+        if(!m) return c;
+        vec3 v(m->velocity[0][lane], m->velocity[1][lane], m->velocity[2][lane]);
+        return c + v * (time - m->time0[lane]);
+    }
+
+    // closest sphere in the packet within [t_min, t_max], nearest root first as in sphere::hit
+    bool intersect(const ray& r, const sphere_motion* m, double t_min, double t_max, int& lane, double& t) const {
+        const double a = dot(r.direction(), r.direction());
+        double ts[4];
+        int mask = 0;
+#if defined(__SSE2__) || defined(_M_X64)
+        const __m128d tm = _mm_set1_pd(r.time());
+        const __m128d lo = _mm_set1_pd(t_min), hi = _mm_set1_pd(t_max), aa = _mm_set1_pd(a);
+        for(int h = 0; h < 4; h += 2){
+            __m128d op[3];
+            for(int k = 0; k < 3; k++){
+                __m128d c = _mm_load_pd(&center[k][h]);
+                if(m) c = _mm_add_pd(c, _mm_mul_pd(_mm_load_pd(&m->velocity[k][h]), _mm_sub_pd(tm, _mm_load_pd(&m->time0[h]))));
+                op[k] = _mm_sub_pd(_mm_set1_pd(r.origin()[k]), c);
+            }
+            __m128d rad = _mm_load_pd(&radius[h]);
+            __m128d c = _mm_sub_pd(_mm_add_pd(_mm_add_pd(_mm_mul_pd(op[0], op[0]), _mm_mul_pd(op[1], op[1])), _mm_mul_pd(op[2], op[2])),
+                                   _mm_mul_pd(rad, rad));
+            __m128d half_b = _mm_add_pd(_mm_add_pd(_mm_mul_pd(_mm_set1_pd(r.direction()[0]), op[0]),
+                                                   _mm_mul_pd(_mm_set1_pd(r.direction()[1]), op[1])),
+                                        _mm_mul_pd(_mm_set1_pd(r.direction()[2]), op[2]));
+            __m128d disc = _mm_sub_pd(_mm_mul_pd(half_b, half_b), _mm_mul_pd(aa, c));
+            __m128d valid = _mm_cmpge_pd(disc, _mm_setzero_pd());
+            // most rays miss every sphere of a leaf, skip the square roots and divisions for them
+            if(_mm_movemask_pd(valid) == 0) continue;
+
+            __m128d sqrtd = _mm_sqrt_pd(disc);
+            __m128d neg_b = _mm_sub_pd(_mm_setzero_pd(), half_b);
+            __m128d near = _mm_div_pd(_mm_sub_pd(neg_b, sqrtd), aa);
+            __m128d far = _mm_div_pd(_mm_add_pd(neg_b, sqrtd), aa);
+            __m128d near_ok = _mm_and_pd(_mm_cmpge_pd(near, lo), _mm_cmple_pd(near, hi));
+            __m128d far_ok = _mm_and_pd(_mm_cmpge_pd(far, lo), _mm_cmple_pd(far, hi));
+            valid = _mm_and_pd(valid, _mm_or_pd(near_ok, far_ok));
+
+            _mm_storeu_pd(&ts[h], _mm_or_pd(_mm_and_pd(near_ok, near), _mm_andnot_pd(near_ok, far)));
+            mask |= _mm_movemask_pd(valid) << h;
+        }
+#else
+        for(int i = 0; i < 4; i++){
+            vec3 op = r.origin() - center_at(i, r.time(), m);
+            double c = dot(op, op) - radius[i] * radius[i];
+            double half_b = dot(r.direction(), op);
+            double disc = half_b * half_b - a * c;
+            if(!(disc >= 0)) continue;
+
+            double sqrtd = sqrt(disc);
+            double root = (-half_b - sqrtd) / a;
+            if(root < t_min || root > t_max){
+                root = (-half_b + sqrtd) / a;
+                if(root < t_min || root > t_max) continue;
+            }
+            ts[i] = root;
+            mask |= 1 << i;
+        }
+#endif
+        if(mask == 0) return false;
+
+        lane = -1;
+        for(int i = 0; i < 4; i++){
+            if((mask & (1 << i)) && (lane < 0 || ts[i] <= ts[lane])) lane = i;
+        }
+        t = ts[lane];
+        return true;
+    }
+};
+
+
+/*
+Many spheres as one primitive, for scenes made of hundreds to millions of them. Instead of a heap
+allocated sphere per object behind its own virtual hit, centers, motion, radii and material indices
+sit in sphere_packets at the leaves of a wide_bvh built with leaves of up to four spheres, each leaf
+exactly one packet. Materials are kept once in a table and referenced by index. Normals and uvs are
+only worked out for the closest hit.
+Spheres are added first and build() then creates the tree for the given shutter interval.
+*/
+class sphere_set : public hittable {
+    public:
+        sphere_set() {}
+
+        void add(const point3& center, double radius, shared_ptr<material> m){
+            staged.push_back({center, vec3(0, 0, 0), 0.0, radius, material_index(m)});
+        }
+
+        // moves linearly from center0 at time0 to center1 at time1, like moving_sphere
+        void add(const point3& center0, const point3& center1, double time0, double time1, double radius, shared_ptr<material> m){
+            staged.push_back({center0, (center1 - center0) / (time1 - time0), time0, radius, material_index(m)});
+        }
+
+        void build(double time0, double time1){
+            std::vector<aabb> boxes(staged.size());
+            for(size_t k = 0; k < staged.size(); k++){
+                const sphere_data& s = staged[k];
+                vec3 extent(s.radius, s.radius, s.radius);
+                point3 c0 = s.center + s.velocity * (time0 - s.time0);
+                point3 c1 = s.center + s.velocity * (time1 - s.time0);
+                boxes[k] = surrounding_box(aabb(c0 - extent, c0 + extent), aabb(c1 - extent, c1 + extent));
+            }
+
+            tree.build(boxes, 4, 4);
+
+            packets.clear();
+            motions.clear();
+            packets.reserve(staged.size() / 2 + 1);
+            tree.pack_leaves([&](const uint32_t* prims, uint32_t n){
+                sphere_packet packet;
+                sphere_motion motion = {};
+                bool moving = false;
+                for(uint32_t lane = 0; lane < n; lane++){
+                    const sphere_data& s = staged[prims[lane]];
+                    for(int a = 0; a < 3; a++){
+                        packet.center[a][lane] = s.center[a];
+                        motion.velocity[a][lane] = s.velocity[a];
+                    }
+                    motion.time0[lane] = s.time0;
+                    packet.radius[lane] = s.radius;
+                    packet.material[lane] = s.material;
+                    moving = moving || s.velocity[0] != 0 || s.velocity[1] != 0 || s.velocity[2] != 0;
+                }
+                if(moving){
+                    packet.motion = (uint32_t)motions.size();
+                    motions.push_back(motion);
+                }
+                packets.push_back(packet);
+                return (uint32_t)(packets.size() - 1);
+            });
+            packets.shrink_to_fit();
+            motions.shrink_to_fit();
+
+            staged = std::vector<sphere_data>();
+            material_ids.clear();
+        }
+
+        virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const override {
+            return deferred_hit(r, t_min, t_max, rec);
+        }
+
+        // the query keeps the packet in id and the lane in part
+        virtual bool intersect(const ray& r, double t_min, double t_max, hit_query& query, hit_record&) const override {
+            return tree.traverse_leaves(r, t_min, t_max, [&](uint32_t first, uint32_t n, double& closest){
+                bool hit_anything = false;
+                for(uint32_t k = first; k < first + n; k++){
+                    int lane;
+                    double t;
+                    if(packets[k].intersect(r, motion_of(packets[k]), t_min, closest, lane, t)){
+                        closest = t;
+                        query.t = t;
+                        query.id = k;
+                        query.part = (uint32_t)lane;
+                        hit_anything = true;
+                    }
+                }
+                return hit_anything;
+            });
+        }
+
+        virtual bool occluded(const ray& r, double t_min, double t_max) const override {
+            return tree.any_hit_leaves(r, t_min, t_max, [&](uint32_t first, uint32_t n){
+                for(uint32_t k = first; k < first + n; k++){
+                    int lane;
+                    double t;
+                    if(packets[k].intersect(r, motion_of(packets[k]), t_min, t_max, lane, t)) return true;
+                }
+                return false;
+            });
+        }
+
+        virtual void evaluate_surface(const ray& r, const hit_query& query, hit_record& rec) const override {
+            const sphere_packet& packet = packets[query.id];
+            int hit_lane = (int)query.part;
+            rec.t = query.t;
+            rec.p = r.at(rec.t);
+            const sphere_motion* motion = motion_of(packet);
+            vec3 outward_normal = (rec.p - packet.center_at(hit_lane, r.time(), motion)) / packet.radius[hit_lane];
+            rec.set_face_normal(r, outward_normal);
+
+            // uvs as sphere gives them; moving spheres have none, as with moving_sphere
+            bool moving = motion && (motion->velocity[0][hit_lane] != 0 || motion->velocity[1][hit_lane] != 0
+                                     || motion->velocity[2][hit_lane] != 0);
+            if(moving) rec.u = rec.v = 0;
+            else sphere::get_sphere_uv(outward_normal, rec.u, rec.v);
+            rec.mat_ptr = materials[packet.material[hit_lane]].get();
+        }
+
+        // emissive spheres that stay put become lights of their own. moving ones have nothing to
+        // sample them with, as with moving_sphere
+        virtual void collect_emitters(const shared_ptr<hittable>&, std::vector<emitter>& out) const override {
+            for(const sphere_packet& packet : packets){
+                const sphere_motion* motion = motion_of(packet);
+                for(int lane = 0; lane < 4; lane++){
+                    if(std::isnan(packet.radius[lane])) continue;
+                    const shared_ptr<material>& m = materials[packet.material[lane]];
+                    if(emitted_power(*m, 1) <= 0) continue;
+                    if(motion && (motion->velocity[0][lane] != 0 || motion->velocity[1][lane] != 0
+                                  || motion->velocity[2][lane] != 0)) continue;
+
+                    auto light = make_shared<sphere>(packet.center_at(lane, 0, nullptr), packet.radius[lane], m);
+                    light->collect_emitters(light, out);
+                }
+            }
+        }
+
+        virtual bool bounding_box(double, double, aabb& output_box) const override {
+            if(tree.empty()) return false;
+            output_box = tree.bounds();
+            return true;
+        }
+
+    public:
+        std::vector<sphere_packet> packets;
+        std::vector<sphere_motion> motions;
+        std::vector<shared_ptr<material>> materials;
+        wide_bvh tree;
+
+    private:
+        struct sphere_data {
+            point3 center;
+            vec3 velocity;
+            double time0;
+            double radius;
+            uint32_t material;
+        };
+
+        std::vector<sphere_data> staged;
+        std::unordered_map<const material*, uint32_t> material_ids;
+
+        const sphere_motion* motion_of(const sphere_packet& packet) const {
+            return packet.motion == sphere_packet::no_motion ? nullptr : &motions[packet.motion];
+        }
+
+        uint32_t material_index(const shared_ptr<material>& m){
+            auto found = material_ids.emplace(m.get(), (uint32_t)materials.size());
+            if(found.second) materials.push_back(m);
+            return found.first->second;
+        }
+};
+
+
+#endif
@@ -10,7 +10,11 @@ class torus : public hittable {
         torus(){}
         torus(point3 cen, double r_mjr, double r_mnr, shared_ptr<material> m) : center(cen), radius_major(r_mjr), radius_minor(r_mnr), mat_ptr(m) {};
 
-        virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const override;
+        virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const override {
+            return deferred_hit(r, t_min, t_max, rec);
+        }
+        virtual bool intersect(const ray& r, double t_min, double t_max, hit_query& query, hit_record& rec) const override;
+        virtual void evaluate_surface(const ray& r, const hit_query& query, hit_record& rec) const override;
         virtual bool bounding_box(double time0, double time1, aabb& output_box) const override;
 
 
@@ -37,7 +41,7 @@ class torus : public hittable {
 
 };
 
-bool torus::hit(const ray& r, double t_min, double t_max, hit_record& rec) const {
+bool torus::intersect(const ray& r, double t_min, double t_max, hit_query& query, hit_record&) const {
     // solve ray - torus intersection
     // solution is given by quartic ax^4 + bx^3 + cx^2 + dx + e
     int num_roots;
@@ -64,12 +68,7 @@ bool torus::hit(const ray& r, double t_min, double t_max, hit_record& rec) const
     std::sort(s,s+num_roots);
     for(int i = 0; i < num_roots; i++){
         if(s[i] >= t_min && s[i] <= t_max){
-            rec.t = s[i];
-            rec.p = r.at(s[i]);
-            auto point_on_torus = rec.p - center;
-            auto outward_normal = ( point_on_torus - radius_major * unit_vector(point_on_torus - vec3(0,0,point_on_torus.z())) ) / radius_minor;
-            rec.set_face_normal(r, outward_normal);
-            rec.mat_ptr = mat_ptr;
+            query.t = s[i];
             return true;
         }
     }
@@ -77,6 +76,15 @@ bool torus::hit(const ray& r, double t_min, double t_max, hit_record& rec) const
     return false;
 }
 
+void torus::evaluate_surface(const ray& r, const hit_query& query, hit_record& rec) const {
+    rec.t = query.t;
+    rec.p = r.at(rec.t);
+    auto point_on_torus = rec.p - center;
+    auto outward_normal = ( point_on_torus - radius_major * unit_vector(point_on_torus - vec3(0,0,point_on_torus.z())) ) / radius_minor;
+    rec.set_face_normal(r, outward_normal);
+    rec.mat_ptr = mat_ptr.get();
+}
+
 bool torus::bounding_box(double time0, double time1, aabb& output_box) const{
     output_box  = aabb(center - point3(radius_major + radius_minor,radius_major+radius_minor,radius_major+radius_minor), center + point3(radius_major + radius_minor,radius_major+radius_minor,radius_major+radius_minor));  
     return true;
@@ -1,10 +1,16 @@
 #ifndef TRIANGLE_H
 #define TRIANGLE_H
 
+#include <cstdint>
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#endif
+
 #include "hittable.h"
 #include "ray.h"
 #include "rtweekend.h"
 #include "vec2.h"
+#include "material.h"
 
 
 // refer to https://www.scratchapixel.com/lessons/3d-basic-rendering/ray-tracing-rendering-a-triangle/moller-trumbore-ray-triangle-intersection.html
@@ -82,7 +88,18 @@ class triangle : public hittable {
         
 
 
-        virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const override;
+        virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const override {
+            return deferred_hit(r, t_min, t_max, rec);
+        }
+        virtual bool intersect(const ray& r, double t_min, double t_max, hit_query& query, hit_record& rec) const override;
+        virtual void evaluate_surface(const ray& r, const hit_query& query, hit_record& rec) const override;
+
+        virtual double pdf_value(const point3& o, const vec3& v) const override;
+        virtual vec3 random(const point3& o) const override;
+
+        virtual void collect_emitters(const shared_ptr<hittable>& self, std::vector<emitter>& out) const override {
+            collect_if_emitting(self, *mat_ptr, 0.5 * cross(v1 - v0, v2 - v0).length(), out);
+        }
         
         
         virtual bool bounding_box(double time0, double time1, aabb& output_rect) const override {
@@ -105,11 +122,11 @@ class triangle : public hittable {
 
 };
 
-bool triangle::hit(const ray& r, double t_min, double t_max, hit_record& rec) const{
+bool triangle::intersect(const ray& r, double t_min, double t_max, hit_query& query, hit_record&) const{
             vec3 v01 = v1 - v0;
             vec3 v02 = v2 - v0;
             vec3 p = cross(r.direction(), v02);
-            float det = dot(v01, p);
+            double det = dot(v01, p);
 
             // no hit if ray is perpendicular to triangle normal
             if(is_zero(det)){
@@ -119,32 +136,246 @@ bool triangle::hit(const ray& r, double t_min, double t_max, hit_record& rec) co
                 return false;
             }
 
-            float invDet = 1 / det;
+            double invDet = 1 / det;
             vec3 vt = r.origin() - v0;
-            float u = dot(p,vt) * invDet;
+            double u = dot(p,vt) * invDet;
             if(u < 0 || u > 1) return false;
 
             vec3 q = cross(vt, v01);
-            float v = dot(r.direction(), q) * invDet;
+            double v = dot(r.direction(), q) * invDet;
             if(v < 0 || u + v > 1) return false;
-            float t = dot(q, v02) * invDet;
+            double t = dot(q, v02) * invDet;
 
             if(t < t_min || t > t_max) return false;
 
+            query.t = t;
+            query.u = u;
+            query.v = v;
+            return true;
+        }
+
+void triangle::evaluate_surface(const ray& r, const hit_query& query, hit_record& rec) const{
+            double u = query.u, v = query.v;
             vec2 vt_r = (1 - u - v) * vt0 + u * vt1 + v * vt2;
             vec3 normal = (1 - u - v) * n0 + u * n1 + v * n2;
-            rec.t = t;
+            rec.t = query.t;
             rec.u = vt_r[0];
             rec.v = vt_r[1];
             rec.p = r.at(rec.t);
             
             rec.set_face_normal(r, unit_vector(normal));
-            rec.mat_ptr = mat_ptr;
+            rec.mat_ptr = mat_ptr.get();
+        }
+
+// points are sampled uniformly over the area, converted to solid angle with the geometric normal
+double triangle::pdf_value(const point3& o, const vec3& v) const {
+    hit_query query;
+    hit_record rec;
+    if(!this->intersect(ray(o, v), 0.001, infinity, query, rec)) return 0;
+
+    vec3 normal = cross(v1 - v0, v2 - v0);
+    double double_area = normal.length();
+    double distance_squared = query.t * query.t * v.length_squared();
+    double cosine = fabs(dot(v, normal)) / (v.length() * double_area);
+    return distance_squared / (cosine * 0.5 * double_area);
+}
+
+vec3 triangle::random(const point3& o) const {
+    double s = sqrt(random_double());
+    double b = random_double();
+    point3 p = v0 + s * (1 - b) * (v1 - v0) + s * b * (v2 - v0);
+    return p - o;
+}
 
-            return true;   
 
+// compact storage used by triangle_mesh. a mesh keeps one shared buffer of unique vertices and four
+// indices per face into it, and next to that the intersection data the hot loop needs, packed four
+// faces at a time in single precision.
 
+struct mesh_vertex {
+    float p[3];
+    float n[3];
+    float uv[2];
+};
+
+// the ray in the precision of face_packet, converted once per mesh rather than once per packet
+struct packet_ray {
+    float orig[3];
+    float dir[3];
+
+    explicit packet_ray(const ray& r){
+        for(int a = 0; a < 3; a++){
+            orig[a] = (float)r.origin()[a];
+            dir[a] = (float)r.direction()[a];
         }
+    }
+};
+
+/*
+Up to four mesh faces laid out structure of arrays, one per lane, for a moller trumbore kernel that
+tests all of them at once (SSE, with a plain loop giving the same results elsewhere). A face is a
+triangle (d0, d1, a), or a quad made of that triangle and (d1, d0, b) on the other side of the shared
+diagonal d0-d1, stored as d0 and the edges leaving it so both halves share the setup work. Lanes
+without a face are all zero, which the kernel rejects as degenerate. The kernel only produces t and
+the barycentrics of the closest lane; everything else is looked up afterwards for that face alone.
+*/
+struct alignas(16) face_packet {
+    float v0[3][4]; // d0
+    float e1[3][4]; // d1 - d0
+    float e2[3][4]; // a - d0
+    float e3[3][4]; // b - d0, quads only
+    uint32_t face[4];
+    uint32_t flags[4];
+
+    static const uint32_t has_uv = 1;
+    static const uint32_t has_normal = 2;
+    static const uint32_t is_quad = 4;
+
+    face_packet() : v0{}, e1{}, e2{}, e3{}, face{}, flags{} {}
+
+    // closest face in the packet within [t_min, t_max]. u weighs d1, v weighs a (half 0) or b (half 1).
+    // the second half of a quad faces the other way round the diagonal, so its back side has the
+    // opposite sign
+    bool intersect(const packet_ray& r, double t_min, double t_max, bool doubleface,
+                   int& lane, double& t, double& u, double& v, int& half) const {
+        const float eps = (float)EQN_EPS;
+#if defined(__SSE2__) || defined(_M_X64)
+        const __m128 d[3] = {_mm_set1_ps(r.dir[0]), _mm_set1_ps(r.dir[1]), _mm_set1_ps(r.dir[2])};
+        const __m128 lo = _mm_set1_ps((float)t_min), hi = _mm_set1_ps((float)t_max);
+        const __m128 zero = _mm_setzero_ps(), one = _mm_set1_ps(1.0f);
+
+        __m128 a[3], vt[3], q[3];
+        for(int k = 0; k < 3; k++){
+            a[k] = _mm_load_ps(e1[k]);
+            vt[k] = _mm_sub_ps(_mm_set1_ps(r.orig[k]), _mm_load_ps(v0[k]));
+        }
+        q[0] = _mm_sub_ps(_mm_mul_ps(vt[1], a[2]), _mm_mul_ps(vt[2], a[1]));
+        q[1] = _mm_sub_ps(_mm_mul_ps(vt[2], a[0]), _mm_mul_ps(vt[0], a[2]));
+        q[2] = _mm_sub_ps(_mm_mul_ps(vt[0], a[1]), _mm_mul_ps(vt[1], a[0]));
+
+        auto hit_half = [&](const float (&edge)[3][4], int cull, __m128& tt, __m128& uu, __m128& vv){
+            __m128 b[3] = {_mm_load_ps(edge[0]), _mm_load_ps(edge[1]), _mm_load_ps(edge[2])};
+            __m128 p[3];
+            p[0] = _mm_sub_ps(_mm_mul_ps(d[1], b[2]), _mm_mul_ps(d[2], b[1]));
+            p[1] = _mm_sub_ps(_mm_mul_ps(d[2], b[0]), _mm_mul_ps(d[0], b[2]));
+            p[2] = _mm_sub_ps(_mm_mul_ps(d[0], b[1]), _mm_mul_ps(d[1], b[0]));
+            __m128 det = dot3(a, p);
+
+            // no hit if ray is perpendicular to triangle normal, or a culled back face
+            __m128 valid = _mm_or_ps(_mm_cmpge_ps(det, _mm_set1_ps(eps)), _mm_cmple_ps(det, _mm_set1_ps(-eps)));
+            if(cull > 0) valid = _mm_and_ps(valid, _mm_cmple_ps(det, zero));
+            if(cull < 0) valid = _mm_and_ps(valid, _mm_cmpge_ps(det, zero));
+
+            __m128 inv_det = _mm_div_ps(one, det);
+            uu = _mm_mul_ps(dot3(p, vt), inv_det);
+            vv = _mm_mul_ps(dot3(d, q), inv_det);
+            tt = _mm_mul_ps(dot3(q, b), inv_det);
+            valid = _mm_and_ps(valid, _mm_and_ps(_mm_cmpge_ps(uu, zero), _mm_cmple_ps(uu, one)));
+            valid = _mm_and_ps(valid, _mm_and_ps(_mm_cmpge_ps(vv, zero), _mm_cmple_ps(_mm_add_ps(uu, vv), one)));
+            valid = _mm_and_ps(valid, _mm_and_ps(_mm_cmpge_ps(tt, lo), _mm_cmple_ps(tt, hi)));
+            return valid;
+        };
+
+        __m128 t0, u0, v0_, t1, u1, v1;
+        __m128 valid0 = hit_half(e2, doubleface ? 0 : 1, t0, u0, v0_);
+        int quads = (flags[0] | flags[1] | flags[2] | flags[3]) & is_quad;
+        __m128 take1 = zero;
+        if(quads){
+            __m128 quad_lanes = _mm_castsi128_ps(_mm_cmpgt_epi32(
+                _mm_and_si128(_mm_loadu_si128((const __m128i*)flags), _mm_set1_epi32(is_quad)), _mm_setzero_si128()));
+            __m128 valid1 = _mm_and_ps(hit_half(e3, doubleface ? 0 : -1, t1, u1, v1), quad_lanes);
+            take1 = _mm_or_ps(_mm_and_ps(valid1, _mm_cmple_ps(t1, t0)), _mm_andnot_ps(valid0, valid1));
+            valid0 = _mm_or_ps(valid0, valid1);
+            t0 = select(take1, t1, t0);
+            u0 = select(take1, u1, u0);
+            v0_ = select(take1, v1, v0_);
+        }
+
+        int mask = _mm_movemask_ps(valid0);
+        if(mask == 0) return false;
+
+        float ts[4], us[4], vs[4];
+        _mm_storeu_ps(ts, t0);
+        _mm_storeu_ps(us, u0);
+        _mm_storeu_ps(vs, v0_);
+        int halves = _mm_movemask_ps(take1);
+
+        // closest lane, a later lane winning a tie as a later face would in a scalar loop
+        lane = -1;
+        for(int i = 0; i < 4; i++){
+            if((mask & (1 << i)) && (lane < 0 || ts[i] <= ts[lane])) lane = i;
+        }
+        t = ts[lane];
+        u = us[lane];
+        v = vs[lane];
+        half = (halves >> lane) & 1;
+        return true;
+#else
+        lane = -1;
+        float best_t = 0, best_u = 0, best_v = 0;
+        int best_half = 0;
+        for(int i = 0; i < 4; i++){
+            float a[3], vt[3], q[3];
+            for(int k = 0; k < 3; k++){
+                a[k] = e1[k][i];
+                vt[k] = r.orig[k] - v0[k][i];
+            }
+            q[0] = vt[1] * a[2] - vt[2] * a[1];
+            q[1] = vt[2] * a[0] - vt[0] * a[2];
+            q[2] = vt[0] * a[1] - vt[1] * a[0];
+
+            auto hit_half = [&](const float (&edge)[3][4], int cull, float& tt, float& uu, float& vv){
+                float b[3] = {edge[0][i], edge[1][i], edge[2][i]};
+                float p[3] = {r.dir[1] * b[2] - r.dir[2] * b[1], r.dir[2] * b[0] - r.dir[0] * b[2], r.dir[0] * b[1] - r.dir[1] * b[0]};
+                float det = a[0] * p[0] + a[1] * p[1] + a[2] * p[2];
+                if(!(det >= eps || det <= -eps)) return false;
+                if((cull > 0 && det > 0) || (cull < 0 && det < 0)) return false;
+
+                float inv_det = 1.0f / det;
+                uu = (p[0] * vt[0] + p[1] * vt[1] + p[2] * vt[2]) * inv_det;
+                vv = (r.dir[0] * q[0] + r.dir[1] * q[1] + r.dir[2] * q[2]) * inv_det;
+                tt = (q[0] * b[0] + q[1] * b[1] + q[2] * b[2]) * inv_det;
+                return uu >= 0 && uu <= 1 && vv >= 0 && uu + vv <= 1 && tt >= (float)t_min && tt <= (float)t_max;
+            };
+
+            float tt, uu, vv, t1, u1, v1;
+            bool valid = hit_half(e2, doubleface ? 0 : 1, tt, uu, vv);
+            int h = 0;
+            if((flags[i] & is_quad) && hit_half(e3, doubleface ? 0 : -1, t1, u1, v1) && (!valid || t1 <= tt)){
+                tt = t1;
+                uu = u1;
+                vv = v1;
+                h = 1;
+                valid = true;
+            }
+            if(valid && (lane < 0 || tt <= best_t)){
+                lane = i;
+                best_t = tt;
+                best_u = uu;
+                best_v = vv;
+                best_half = h;
+            }
+        }
+        if(lane < 0) return false;
+        t = best_t;
+        u = best_u;
+        v = best_v;
+        half = best_half;
+        return true;
+#endif
+    }
+
+    private:
+#if defined(__SSE2__) || defined(_M_X64)
+        static __m128 dot3(const __m128 (&x)[3], const __m128 (&y)[3]){
+            return _mm_add_ps(_mm_add_ps(_mm_mul_ps(x[0], y[0]), _mm_mul_ps(x[1], y[1])), _mm_mul_ps(x[2], y[2]));
+        }
+
+        static __m128 select(__m128 mask, __m128 a, __m128 b){
+            return _mm_or_ps(_mm_and_ps(mask, a), _mm_andnot_ps(mask, b));
+        }
+#endif
+};
 
 
 #endif
\ No newline at end of file
@@ -5,470 +5,342 @@
 
 #include <vector>
 #include <iostream>
-#include <fstream>
 #include <string>
-#include <sstream>
-#include <list>
 #include <algorithm>
-#include <iostream>
 #include <unordered_map>
+#include <mutex>
 
 #include "ray.h"
 #include "triangle.h"
 #include "material.h"
 #include "rtweekend.h"
 #include "bvh.h"
+#include "obj_loader.h"
+#include "mesh_snapshot.h"
 
 
-// .obj reference  https://en.wikipedia.org/wiki/Wavefront_.obj_file
-// .obj vertices can be represented in one of the following formats:
-// vertex coordinates, uv_coordinates, and normal coordinates
-// vertex coordinates, uv coordinates
-// vertex coordinates, normal coordinates
-// vertex coordinates
-
-enum vertex_format{
-    V_UV_NORMAL = 7,
-    V_UV = 3,
-    V_NORMAL = 5,
-    V = 1
-
-};
-
-// defines an integer code for each format
-enum vertex_info{
-    VERTEX = 1, 
-    UV = 2,
-    NORMAL = 4
-};
-
-
-class triangle_mesh : public hittable{
+// faces and bvh of one loaded .obj file. it carries no material, so any number of triangle_mesh
+// instances can share it (see geometry_cache below).
+// storage is indexed: unique (position, normal, uv) vertices in one float buffer, four indices per
+// face (d0, d1, a, b, the last unused by triangles), and the intersection data of the faces in
+// face_packets of four. convex quads stay whole, so quad heavy assets get half the primitives. the bvh
+// is the four wide one (wide_bvh) built for leaves of up to four faces, and each leaf holds exactly one
+// packet, so after the build its range indexes packets rather than faces.
+class mesh_geometry {
 
     public:
-        triangle_mesh(){}
-        triangle_mesh(const char* filename, shared_ptr<material> m, int w) : mat_ptr(m), winding(w){
-            
-
-            std::ifstream file;
-
-            try{   
-
-                file.open(filename);
-                if (file.fail()) throw;
-                std::string line = "";   
-                std::istringstream iss;
-                std::string buffer;
-                float param;
-
-                vertex_format input_format_code = V;
-
-
-                while(getline(file, line)){
-                    iss.clear();
-                    iss.str(line);
-                    iss >> buffer;
-                    
-                    if(buffer.compare("vt") == 0){
-                        input_format_code = static_cast<vertex_format>(input_format_code | UV);
-                        vec2 uv;
-                        iss >> uv[0] >> uv[1];
-                        uvs.push_back(uv);
-
-                    }else if(buffer.compare("vn") == 0){
-                        input_format_code =  static_cast<vertex_format>(input_format_code | NORMAL);
-                        vec3 normal;
-                        iss >> normal[0] >> normal[1] >> normal[2];
-                        normals.push_back(normal);
-                        
-
-                    }else if(buffer.compare("v") == 0){
-                        input_format_code =  static_cast<vertex_format>(input_format_code | VERTEX);
-                        vec3 vert;
-                        iss >> vert[0] >> vert[1] >> vert[2];
-                        verts.push_back(vert);
-                    }else if(buffer.compare("f") == 0){
-                        // tokenize the strings based on delimeter
-                        // extract indices from each token
-
-                        while(!iss.eof()){
-                            if(!(iss >> buffer))
-                                break;
-                            
-                            
-                            verts_idx.push_back(0);
-                            normals_idx.push_back(0);
-                            uvs_idx.push_back(0);
-                            
-                            switch(input_format_code){
-                                // case with verts, uvs, normals
-                                case(V_UV_NORMAL):
-                                    sscanf(buffer.c_str(), "%i%*c%i%*c%i%*c", &verts_idx.back(), &uvs_idx.back(), &normals_idx.back());
-                                    // convert line indices to array indices
-                                    verts_idx.back() = verts_idx.back() - 1;
-                                    uvs_idx.back() = uvs_idx.back() - 1;
-                                    normals_idx.back() = normals_idx.back() - 1;
-                                    
-                                    break;
-                                
-                                // case with verts, normals
-                                case(V_NORMAL):
-                                    std::cerr<< "Vertex/Normal parsing not yet implemented."<<std::endl;
-                                    break;
-
-                                // case with verts, uvs
-                                case(V_UV):
-                                    sscanf(buffer.c_str(), "%i%*c%i%*c", &verts_idx.back(), &uvs_idx.back());
-                                    
-                                    //convert line indices to array indices
-                                    verts_idx.back() = verts_idx.back() - 1;
-                                    uvs_idx.back() = uvs_idx.back() - 1;
-                                    break;
-
-
-                                // case with only verts
-                                case(V):
-                                    verts_idx.back() = stoi(buffer);
-                                    // convert line indices to array indices
-                                    verts_idx.back() = verts_idx.back() - 1;
-                                   
-                                    break;    
-                            }
-
-                            
-
-                        }
-
-        
-
-
-                        /**
-                         * Triangulation Algorithm
-                         */
-
-                        int t = 0; 
-                        int t_left = ( (t - 1 * winding) % (int)verts_idx.size() + (int)verts_idx.size() ) % (int)verts_idx.size();
-                        int t_right = ( (t + 1 * winding) % (int)verts_idx.size() + (int)verts_idx.size() ) % (int)verts_idx.size();
-
-                        while((int)verts_idx.size() > 3){
-                            // confirm that three points form an 'ear'
-                            if(is_ear(verts[verts_idx[t]],verts[verts_idx[t_right]],verts[verts_idx[t_left]],normals[normals_idx[t]])){
-
-                                // loop over all other points, check if any one lies in triangle formed by excluded three
-                                bool no_intersection = true;
-                                for(int i = 0;  i < (int)verts_idx.size(); i++){
-                                    if(i == t || i == t_left || i == t_right) continue;
-                                    if(in_triangle(verts[verts_idx[t]], verts[verts_idx[t_right]], verts[verts_idx[t_left]], verts[verts_idx[i]])){
-                                        no_intersection = false;
-                                        break;
-                                    }
-                                }
-
-                                if(no_intersection){
-
-
-
-                                    // tris.push_back(make_shared<triangle>(verts[verts_idx[t]], verts[verts_idx[t_right]], verts[verts_idx[t_left]], normals[normals_idx[t]], mat_ptr, true));
-                                    
-                                    update_triangle_list(input_format_code, t, t_left, t_right);
-                                    sanitize_indices(input_format_code, t);
-                                    //
-                                    // tris.push_back(make_shared<triangle>(verts[verts_idx[t]], verts[verts_idx[t_left]], verts[verts_idx[t_right]], 
-                                    // uvs[uvs_idx[t]], uvs[uvs_idx[t_left]], uvs[uvs_idx[t_right]], 
-                                    // normals[normals_idx[t]], normals[normals_idx[t_left]], normals[normals_idx[t_right]], 
-                                    // mat_ptr, true));
-                                    // sanitize indices 
-                                    // verts_idx.erase(verts_idx.begin() + t);
-                                    // uvs_idx.erase(uvs_idx.begin() + t);
-                                    // normals_idx.erase(normals_idx.begin() + t);    
-
-                                    t = 0;
-
-                                }else{
-                                    t = (t + 1) % (int)verts_idx.size();    
-                                }
-
-                            }else{
-                                t = (t + 1) % (int)verts_idx.size();    
-                            }
-
-                            t_left = ( (t - 1 * winding) % (int)verts_idx.size() + (int)verts_idx.size() ) % (int)verts_idx.size();
-                            t_right = ( (t + 1 * winding) % (int)verts_idx.size() + (int)verts_idx.size() ) % (int)verts_idx.size();
-                        }
-                        // 
-                        // tris.push_back(make_shared<triangle>(verts[verts_idx[t]], verts[verts_idx[t_right]], verts[verts_idx[t_left]], normals[normals_idx[t]], mat_ptr, true));
-                        
-
-                        update_triangle_list(input_format_code, t, t_left, t_right);
-                        clear_indices(input_format_code);
-                        // 
-                        // tris.push_back(make_shared<triangle>(verts[verts_idx[t]], verts[verts_idx[t_left]], verts[verts_idx[t_right]], 
-                        // uvs[uvs_idx[t]], uvs[uvs_idx[t_left]], uvs[uvs_idx[t_right]], 
-                        // normals[normals_idx[t]], normals[normals_idx[t_left]], normals[normals_idx[t_right]],
-                        // mat_ptr, true));
-                        // verts_idx.clear();
-                        // uvs_idx.clear();
-                        // normals_idx.clear();
-                    
-                    }
-
-
-                }
-
-                file.close();
-
-            }catch(...){
-                std::cerr<<"There was a problem with reading the mesh file.";
-                file.close();
+        mesh_geometry(){}
+        mesh_geometry(const char* filename, int w) : winding(w){
+            if(!read_mesh_snapshot(filename, winding, vertices, indices, packets, tree)){
+                obj_data obj = load_obj(filename, winding);
+                build(obj);
+                if(obj.ok) write_mesh_snapshot(filename, winding, vertices, indices, packets, tree);
             }
 
-            std::cerr<<"Mesh "<< filename <<" initialized."<<std::endl;
-            mesh_bvh = make_shared<bvh_node>(tris, (size_t)0, tris.size(), 0, infinity);
-            std::cerr<<"BVH Tree initialized."<<std::endl;
-
-
+            std::cerr<<"Mesh "<< filename <<" initialized, "<< indices.size() / 4 <<" faces."<<std::endl;
         }
 
-        virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const override;
-        virtual bool bounding_box(double time0, double time1, aabb& output_box) const override;
-        // test if point r is in triangle defined by v0, v1, v2
-        bool in_triangle(const vec3 &v0, const vec3 &v1, const vec3 &v2, const vec3 &vp);
-        /*
-        v0: 'left' indexed vertex
-        v1: 'center' indexed vertex
-        v2: 'right' indexed vertex
-        */
-        bool is_ear(const vec3& v0, const vec3 &v1, const vec3 &v2, vec3 &normal);
+        bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const {
+            hit_query query;
+            if(!intersect(r, t_min, t_max, query)) return false;
+            evaluate_surface(r, query, rec);
+            return true;
+        }
 
+        bool intersect(const ray& r, double t_min, double t_max, hit_query& query) const;
+        bool occluded(const ray& r, double t_min, double t_max) const;
+        void evaluate_surface(const ray& r, const hit_query& query, hit_record& rec) const;
 
+        bool bounds(aabb& output_box) const {
+            if(tree.empty()) return false;
+            output_box = tree.bounds();
+            return true;
+        }
 
     public:
-        
-
-
-        std::vector<vec3> verts;
-        std::vector<vec3> normals;
-        std::vector<vec2> uvs;
-        
-        std::vector<int> verts_idx;
-        std::vector<int> normals_idx;
-        std::vector<int> uvs_idx;
-
-        std::vector<shared_ptr<hittable>> tris; 
-        shared_ptr<bvh_node> mesh_bvh;
-        shared_ptr<material> mat_ptr; 
+        std::vector<mesh_vertex> vertices;
+        std::vector<uint32_t> indices;
+        std::vector<face_packet> packets;
+        wide_bvh tree;
 
         int winding;
 
         bool doubleface = true;
 
-
-
     private:
-        bool triangle_hit(const vec3& v0, const vec3& v1, const vec3& v2, 
-                          const vec2& vt0, const vec2& vt1, const vec2& vt2,
-                           const vec3& normal,const ray& r, double t_min, double t_max, hit_record& rec) const;
-
-        void update_triangle_list(vertex_format input_format_code, int t, int t_left, int t_right){ 
-            switch(input_format_code){
-                                case(V_UV_NORMAL): 
-                                    tris.push_back(make_shared<triangle>(verts[verts_idx[t]], verts[verts_idx[t_left]], verts[verts_idx[t_right]], 
-                                    uvs[uvs_idx[t]], uvs[uvs_idx[t_left]], uvs[uvs_idx[t_right]], 
-                                    normals[normals_idx[t]], normals[normals_idx[t_left]], normals[normals_idx[t_right]], 
-                                    mat_ptr, doubleface));                
-                                    break;
-                                
-                                case(V_NORMAL):
-                                    // TO BE IMPLEMENTED
-                                    break;
-
-                                // case with verts, uvs
-                                case(V_UV):
-                                    tris.push_back(make_shared<triangle>(verts[verts_idx[t]], verts[verts_idx[t_left]], verts[verts_idx[t_right]], 
-                                    uvs[uvs_idx[t]], uvs[uvs_idx[t_left]], uvs[uvs_idx[t_right]], 
-                                    mat_ptr, doubleface)); 
-
-                                    break;
-
-
-                                // case with only verts
-                                case(V):
-                                    tris.push_back(make_shared<triangle>(verts[verts_idx[t]], verts[verts_idx[t_left]], verts[verts_idx[t_right]],
-                                    mat_ptr, doubleface));  
-                                    break;    
-                            }
-        }
+        void build(const obj_data& obj);
+};
 
-        // clear entire array
-        void clear_indices(vertex_format input_format_code){
-            switch(input_format_code){
-                                case(V_UV_NORMAL): 
-                                    verts_idx.clear();
-                                    uvs_idx.clear();
-                                    normals_idx.clear();
-                                    break;
-
-                                case(V_NORMAL):
-                                    verts_idx.clear();
-                                    normals_idx.clear();
-                                    break;
-
-                                // case with verts, uvs
-                                case(V_UV):
-                                    verts_idx.clear();
-                                    uvs_idx.clear();
-                                    break;
-
-
-                                // case with only verts
-                                case(V):
-                                    verts_idx.clear();
-                                    break;    
-                            }
 
+void mesh_geometry::build(const obj_data& obj){
+    struct corner_hash {
+        size_t operator()(const obj_corner& c) const {
+            return ((size_t)(uint32_t)c.v * 73856093u) ^ ((size_t)(uint32_t)c.vt * 19349663u) ^ ((size_t)(uint32_t)c.vn * 83492791u);
         }
-        // remove element at index t
-        void sanitize_indices(vertex_format input_format_code, int t){
-                switch(input_format_code){
-                        case(V_UV_NORMAL): 
-                            verts_idx.erase(verts_idx.begin() + t);
-                            uvs_idx.erase(uvs_idx.begin() + t);
-                            normals_idx.erase(normals_idx.begin() + t);
-                            break;
-                        case(V_NORMAL):
-                            verts_idx.erase(verts_idx.begin() + t);
-                            normals_idx.erase(normals_idx.begin() + t);
-                            break;
-
-                        // case with verts, uvs
-                        case(V_UV):
-                            verts_idx.erase(verts_idx.begin() + t);
-                            uvs_idx.erase(uvs_idx.begin() + t);
-                            break;
-
-
-                        // case with only verts
-                        case(V):
-                            verts_idx.erase(verts_idx.begin() + t);
-                            break;    
-                    }
-
+    };
+    struct corner_equal {
+        bool operator()(const obj_corner& a, const obj_corner& b) const {
+            return a.v == b.v && a.vt == b.vt && a.vn == b.vn;
+        }
+    };
+
+    size_t triangle_count = obj.triangle_count();
+    size_t count = triangle_count + obj.quad_count();
+
+    // one vertex per distinct corner
+    std::unordered_map<obj_corner, uint32_t, corner_hash, corner_equal> vertex_ids;
+    vertex_ids.reserve(obj.positions.size());
+    auto vertex_id = [&](const obj_corner& c){
+        auto found = vertex_ids.emplace(c, (uint32_t)vertices.size());
+        if(found.second){
+            mesh_vertex vert = {};
+            for(int a = 0; a < 3; a++) vert.p[a] = (float)obj.positions[c.v][a];
+            if(c.vn >= 0) for(int a = 0; a < 3; a++) vert.n[a] = (float)obj.normals[c.vn][a];
+            if(c.vt >= 0) for(int a = 0; a < 2; a++) vert.uv[a] = (float)obj.uvs[c.vt][a];
+            vertices.push_back(vert);
+        }
+        return found.first->second;
+    };
+
+    // per face intersection data, gathered into packets once the tree has grouped the faces
+    struct face_data {
+        float v0[3], e1[3], e2[3], e3[3];
+        uint32_t flags;
+    };
+
+    indices.resize(4 * count);
+    std::vector<face_data> staged(count);
+    std::vector<aabb> boxes(count);
+
+    for(size_t k = 0; k < count; k++){
+        bool quad = k >= triangle_count;
+        int corner_count = quad ? 4 : 3;
+        const obj_corner* c = quad ? &obj.quad_corners[4 * (k - triangle_count)] : &obj.corners[3 * k];
+        face_data& face = staged[k];
+
+        face.flags = quad ? face_packet::is_quad : 0;
+        bool has_uv = true, has_normal = true;
+        for(int i = 0; i < corner_count; i++){
+            has_uv = has_uv && c[i].vt >= 0;
+            has_normal = has_normal && c[i].vn >= 0;
+            indices[4 * k + i] = vertex_id(c[i]);
+        }
+        if(!quad) indices[4 * k + 3] = indices[4 * k];
+        if(has_uv) face.flags |= face_packet::has_uv;
+        if(has_normal) face.flags |= face_packet::has_normal;
+
+        const point3& p0 = obj.positions[c[0].v];
+        for(int a = 0; a < 3; a++){
+            face.v0[a] = (float)p0[a];
+            face.e1[a] = (float)(obj.positions[c[1].v][a] - p0[a]);
+            face.e2[a] = (float)(obj.positions[c[2].v][a] - p0[a]);
+            face.e3[a] = quad ? (float)(obj.positions[c[3].v][a] - p0[a]) : 0.0f;
         }
 
-
-
-
-};
-
-// at the moment is copy of hittable_list hit func.
-bool triangle_mesh::hit(const ray& r, double t_min, double t_max, hit_record& rec) const {
-    
-    return mesh_bvh->hit(r, t_min, t_max, rec);
-    // hit_record temp_rec;
-    // bool hit_anything = false;
-    // double closest_so_far = t_max;
-    
-    // for(const auto& tri : tris){
-    //     if(tri->hit(r, t_min, closest_so_far, temp_rec)){
-    //         hit_anything = true;
-    //         closest_so_far = temp_rec.t;
-    //         rec = temp_rec;
-    //     }
-    // }
-
-    // return hit_anything;
-
-}
-
-bool triangle_mesh::triangle_hit(const vec3& v0, const vec3& v1, const vec3& v2, 
-                                 const vec2& vt0, const vec2& vt1, const vec2& vt2,
-                                 const vec3& normal,const ray& r, double t_min, double t_max, hit_record& rec) const{
-            
-            
-            vec3 v02 = v2 - v0;
-            vec3 v01 = v1 - v0;
-            vec3 p = cross(r.direction(), v02);
-            float det = dot(v01, p);
-
-            // no hit if ray is perpendicular to triangle normal
-            if(is_zero(det)){
-                return false;
-            // no hit if backface culling
-            }else if(!doubleface && det > 0){
-                return false;
+        // bounds of the face as it will be intersected, padded for axis aligned faces
+        for(int a = 0; a < 3; a++){
+            double x0 = face.v0[a];
+            double lo = fmin(fmin(x0, x0 + face.e1[a]), x0 + face.e2[a]);
+            double hi = fmax(fmax(x0, x0 + face.e1[a]), x0 + face.e2[a]);
+            if(quad){
+                lo = fmin(lo, x0 + face.e3[a]);
+                hi = fmax(hi, x0 + face.e3[a]);
             }
-
-            float invDet = 1 / det;
-            vec3 vt = r.origin() - v0;
-            float u = dot(p,vt) * invDet;
-            if(u < 0 || u > 1) return false;
-
-            vec3 q = cross(vt, v01);
-            float v = dot(r.direction(), q) * invDet;
-            if(v < 0 || u + v > 1) return false;
-            float t = dot(q, v02) * invDet;
-
-            if(t < t_min || t > t_max) return false;
-            vec2 vt_r = u * vt0 + v * vt1 + (1 - u - v) * vt2;
-            rec.t = t;
-            rec.u = vt_r[0];
-            rec.v = vt_r[1];
-            rec.p = r.at(rec.t);
-            rec.set_face_normal(r, unit_vector(normal));
-            rec.mat_ptr = mat_ptr;
-            return true;   
-
-
+            boxes[k].minimum.e[a] = lo - 0.0001;
+            boxes[k].maximum.e[a] = hi + 0.0001;
         }
+    }
+
+    // leaves of at most four faces, priced as one packet test each
+    tree.build(boxes, 4, 4);
+
+    packets.reserve(count / 2 + 1);
+    tree.pack_leaves([&](const uint32_t* prims, uint32_t n){
+        face_packet packet;
+        for(uint32_t lane = 0; lane < n; lane++){
+            const face_data& face = staged[prims[lane]];
+            for(int a = 0; a < 3; a++){
+                packet.v0[a][lane] = face.v0[a];
+                packet.e1[a][lane] = face.e1[a];
+                packet.e2[a][lane] = face.e2[a];
+                packet.e3[a][lane] = face.e3[a];
+            }
+            packet.face[lane] = prims[lane];
+            packet.flags[lane] = face.flags;
+        }
+        packets.push_back(packet);
+        return (uint32_t)(packets.size() - 1);
+    });
+    packets.shrink_to_fit();
+}
 
 
+// only t and the barycentrics are tracked during traversal. the query keeps the packet in id, and the
+// lane and quad half in part (lane | half << 2)
+bool mesh_geometry::intersect(const ray& r, double t_min, double t_max, hit_query& query) const {
+    const packet_ray packed(r);
+
+    return tree.traverse_leaves(r, t_min, t_max, [&](uint32_t first, uint32_t count, double& closest){
+        bool hit_anything = false;
+        for(uint32_t k = first; k < first + count; k++){
+            double t, u, v;
+            int lane, half;
+            if(packets[k].intersect(packed, t_min, closest, doubleface, lane, t, u, v, half)){
+                closest = t;
+                query.t = t;
+                query.u = u;
+                query.v = v;
+                query.id = k;
+                query.part = (uint32_t)(lane | half << 2);
+                hit_anything = true;
+            }
+        }
+        return hit_anything;
+    });
+}
 
 
+bool mesh_geometry::occluded(const ray& r, double t_min, double t_max) const {
+    const packet_ray packed(r);
 
+    return tree.any_hit_leaves(r, t_min, t_max, [&](uint32_t first, uint32_t count){
+        for(uint32_t k = first; k < first + count; k++){
+            double t, u, v;
+            int lane, half;
+            if(packets[k].intersect(packed, t_min, t_max, doubleface, lane, t, u, v, half)) return true;
+        }
+        return false;
+    });
+}
 
 
+// everything else, filled in once for the closest face. the material is left to the instance
+void mesh_geometry::evaluate_surface(const ray& r, const hit_query& query, hit_record& rec) const {
+    const face_packet& packet = packets[query.id];
+    int hit_lane = query.part & 3, hit_half = query.part >> 2;
+    double hit_u = query.u, hit_v = query.v;
+
+    uint32_t face = packet.face[hit_lane];
+    uint32_t flags = packet.flags[hit_lane];
+    const mesh_vertex& d0 = vertices[indices[4 * face]];
+    const mesh_vertex& d1 = vertices[indices[4 * face + 1]];
+    const mesh_vertex& c = vertices[indices[4 * face + 2 + hit_half]];
+    double w = 1 - hit_u - hit_v;
+
+    rec.t = query.t;
+    rec.p = r.at(rec.t);
+
+    // faces without uvs get the default triangle uvs (1,0), (0,1), (0,0), in corner order of the half
+    // that was hit: (d0, d1, a) or (d1, d0, b)
+    if(flags & face_packet::has_uv){
+        rec.u = w * d0.uv[0] + hit_u * d1.uv[0] + hit_v * c.uv[0];
+        rec.v = w * d0.uv[1] + hit_u * d1.uv[1] + hit_v * c.uv[1];
+    }else{
+        rec.u = hit_half == 0 ? w : hit_u;
+        rec.v = hit_half == 0 ? hit_u : w;
+    }
+
+    vec3 normal;
+    if(flags & face_packet::has_normal){
+        normal = vec3(w * d0.n[0] + hit_u * d1.n[0] + hit_v * c.n[0],
+                      w * d0.n[1] + hit_u * d1.n[1] + hit_v * c.n[1],
+                      w * d0.n[2] + hit_u * d1.n[2] + hit_v * c.n[2]);
+    }else{
+        int l = hit_lane;
+        vec3 e1(packet.e1[0][l], packet.e1[1][l], packet.e1[2][l]);
+        normal = hit_half == 0 ? cross(e1, vec3(packet.e2[0][l], packet.e2[1][l], packet.e2[2][l]))
+                               : cross(vec3(packet.e3[0][l], packet.e3[1][l], packet.e3[2][l]), e1);
+    }
+    rec.set_face_normal(r, unit_vector(normal));
+    rec.mat_ptr = nullptr;
+}
 
 
-bool triangle_mesh::in_triangle(const vec3 &v0, const vec3 &v1, const vec3 &v2, const vec3 &vp){
-    // vij refers to vector from point i to point j
-    vec3 v01 = v1 - v0;
-    vec3 v12 = v2 - v1;
-    vec3 v20 = v0 - v2;
-
-    vec3 v0p = vp - v0;
-    vec3 v1p = vp - v1;
-    vec3 v2p = vp - v2;
+// loaded meshes keyed by path and winding. entries are weak so a mesh is freed once the last
+// instance using it goes away, and loading the same file again while it is alive only costs a lookup
+class geometry_cache {
+    public:
+        static shared_ptr<const mesh_geometry> load(const char* filename, int winding){
+            static std::mutex lock;
+            static std::unordered_map<std::string, std::weak_ptr<const mesh_geometry>> entries;
 
-    // to be safe, project vp onto plane formed by the three points
+            std::string key = std::string(filename) + '|' + std::to_string(winding);
+            std::lock_guard<std::mutex> guard(lock);
 
-    vec3 compare_to = cross(v01, v0p);
+            if(auto cached = entries[key].lock()) return cached;
 
+            auto geometry = make_shared<const mesh_geometry>(filename, winding);
+            entries[key] = geometry;
+            return geometry;
+        }
+};
 
 
-    if(dot(compare_to, cross(v20, v2p)) < 0) return false;
+// an instance of a cached mesh with its own material. placement comes from the transform
+// wrappers around it, so copies of an asset only add this small node to the scene
+class triangle_mesh : public hittable{
+    public:
+        triangle_mesh(){}
+        triangle_mesh(const char* filename, shared_ptr<material> m, int w)
+        : geometry(geometry_cache::load(filename, w)), mat_ptr(m) {}
 
-    if(dot(compare_to, cross(v12, v1p)) < 0) return false;
+        triangle_mesh(shared_ptr<const mesh_geometry> g, shared_ptr<material> m)
+        : geometry(g), mat_ptr(m) {}
 
+        virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const override {
+            return deferred_hit(r, t_min, t_max, rec);
+        }
 
+        virtual bool intersect(const ray& r, double t_min, double t_max, hit_query& query, hit_record&) const override {
+            return geometry->intersect(r, t_min, t_max, query);
+        }
 
-    return true;
+        virtual bool occluded(const ray& r, double t_min, double t_max) const override {
+            return geometry->occluded(r, t_min, t_max);
+        }
 
+        // an emissive mesh is one light per triangle, quads split into their two halves
+        virtual void collect_emitters(const shared_ptr<hittable>&, std::vector<emitter>& out) const override {
+            if(emitted_power(*mat_ptr, 1) <= 0) return;
+
+            const mesh_geometry& g = *geometry;
+            auto position = [&](uint32_t index){
+                const float* p = g.vertices[index].p;
+                return point3(p[0], p[1], p[2]);
+            };
+            // which faces are quads is only recorded in the packets
+            std::vector<bool> quad(g.indices.size() / 4, false);
+            for(const face_packet& packet : g.packets){
+                for(int lane = 0; lane < 4; lane++){
+                    if(packet.flags[lane] & face_packet::is_quad) quad[packet.face[lane]] = true;
+                }
+            }
 
-}
+            for(size_t face = 0; face < quad.size(); face++){
+                const uint32_t* corner = &g.indices[4 * face];
+                point3 d0 = position(corner[0]), d1 = position(corner[1]);
+                auto half = make_shared<triangle>(d0, d1, position(corner[2]), mat_ptr, g.doubleface);
+                half->collect_emitters(half, out);
+                if(quad[face]){
+                    half = make_shared<triangle>(d1, d0, position(corner[3]), mat_ptr, g.doubleface);
+                    half->collect_emitters(half, out);
+                }
+            }
+        }
 
-bool triangle_mesh::is_ear(const vec3& v0, const vec3 &v1, const vec3 &v2, vec3 &normal){
-    // v1 - v0 is side formed by vertex tested to be ear(v1) and previous indexed vertex
-    // v0 - v2 is side formed by vertex tested to be ear(v2) and next indexed vertex
-    
-    if(dot(cross(v1 - v0, v0 - v2),normal) > 0) return true;
-    return false;
+        virtual void evaluate_surface(const ray& r, const hit_query& query, hit_record& rec) const override {
+            geometry->evaluate_surface(r, query, rec);
+            rec.mat_ptr = mat_ptr.get();
+        }
 
-}
+        virtual bool bounding_box(double, double, aabb& output_box) const override {
+            return geometry->bounds(output_box);
+        }
 
-bool triangle_mesh::bounding_box(double time0, double time1, aabb& output_box) const{
-    mesh_bvh->bounding_box(time0, time1, output_box);
-    return true;
-}
+    public:
+        shared_ptr<const mesh_geometry> geometry;
+        shared_ptr<material> mat_ptr;
+};
 
 
 #endif
\ No newline at end of file
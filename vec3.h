@@ -121,19 +121,19 @@ inline static vec3 random(double min, double max){
     return vec3(random_double(min,max), random_double(min,max), random_double(min,max));
 }
 
-vec3 random_in_unit_sphere(){ 
-    while (true) {
-            auto p = random(-1,1);
-            if (p.length_squared() >= 1) continue;
-            return p;
-        }
-    // black grains when using w/ trilinear interpolated perlin noise for some reason
-    // double r = random_double();// generate random point in spherical -> convert to cartesian
-    // double theta = random_double(-pi, pi);
-    // double phi = random_double(0, 2 * pi);
-
-    // return vec3( r * sin(theta) * cos(phi), r * sin(theta) * sin(phi), r * cos(theta));
+// the random_* points below are direct mappings rather than rejection loops, so each one takes a fixed
+// number of sample dimensions (see sampler.h)
+vec3 random_unit_vector(){
+    double z = 1 - 2 * random_double();
+    double phi = 2 * pi * random_double();
+    double r = sqrt(fmax(0.0, 1 - z * z));
+    return vec3(r * cos(phi), r * sin(phi), z);
+}
 
+vec3 random_in_unit_sphere(){ 
+    // uniform in volume, so the radius goes with the cube root
+    vec3 direction = random_unit_vector();
+    return cbrt(random_double()) * direction;
 }
 
 
@@ -150,17 +150,10 @@ vec3 random_cosine_direction(){
 }
 
 
-vec3 random_unit_vector(){
-    return unit_vector(random_in_unit_sphere());
-}
-
-
 vec3 random_in_unit_disk(){
-    while(true){
-        auto p = vec3(random_double(-1,1), random_double(-1,1), 0);
-        if(p.length_squared() >= 1) continue;
-        return p;
-    }
+    double r = sqrt(random_double());
+    double phi = 2 * pi * random_double();
+    return vec3(r * cos(phi), r * sin(phi), 0);
 }
 vec3 reflect(const vec3& v, const vec3& n){
     return v - 2 * dot(v,n) * n;